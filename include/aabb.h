@@ -22,39 +22,50 @@ public:
     
     inline vec3 size() const { return maximum - minimum; }
 
+    inline point3 center() const { return (minimum + maximum) * 0.5; }
+
+    inline bool is_valid() const
+    {
+        return minimum.x <= maximum.x && minimum.y <= maximum.y && minimum.z <= maximum.z;
+    }
+
+    inline fType surface_area() const
+    {
+        if (!is_valid())
+            return 0.0;
+
+        vec3 d = size();
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
     void reset(const point3& a, const point3& b)
     {
         minimum = a;
         maximum = b;
     }
     
-    //fast verision by Andrew Kensler at Pixar
+    inline const point3& bound(int i) const { return i ? maximum : minimum; }
+
     inline bool hit(const ray& r, fType t_min, fType t_max) const
     {
-        for (int i = 0; i < 3; i++) 
+        fType t_near;
+        return hit(r, t_min, t_max, t_near);
+    }
+
+    //branchless slab test (Williams et al.) using the ray's reciprocal direction and signs,
+    //rays parallel to a slab get infinite slab distances so no special case is needed
+    inline bool hit(const ray& r, fType t_min, fType t_max, fType& t_near) const
+    {
+        for (int i = 0; i < 3; i++)
         {
-            fType origin = r.origin[i], minVal = minimum[i], maxVal = maximum[i];
-
-            //The ray is parallel to the planes
-            if (r.direction[i] == 0)
-            {
-				if (origin < minVal || origin > maxVal)
-					return false;
-            }
-            else
-            {
-				fType invD = 1.0 / r.direction[i];
-				fType t0 = (minVal - origin) * invD;
-				fType t1 = (maxVal - origin) * invD;
-				if (invD < 0.0)
-					std::swap(t0, t1);
-				t_min = t0 > t_min ? t0 : t_min;
-				t_max = t1 < t_max ? t1 : t_max;
-				if (t_max < t_min)
-					return false;
-            }
+            fType t0 = (bound(r.sign[i])[i] - r.origin[i]) * r.inv_direction[i];
+            fType t1 = (bound(1 - r.sign[i])[i] - r.origin[i]) * r.inv_direction[i];
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
         }
-        return true;
+
+        t_near = t_min;
+        return t_min <= t_max;
     }
     
 	void surrounding_box(shared_ptr<aabb> box0, shared_ptr<aabb> box1)
@@ -70,7 +81,7 @@ public:
 		this->reset(small, big);
 	}
 
-	void extand(point3& p)
+	void extand(const point3& p)
 	{
         for (int i = 0; i < 3; i++)
         {
@@ -81,11 +92,16 @@ public:
 
 
 	void extand(shared_ptr<aabb> box)
+	{
+		extand(*box);
+	}
+
+	void extand(const aabb& box)
 	{
 		for (int i = 0; i < 3; i++)
 		{
-			minimum[i] = std::min(minimum[i], box->minimum[i]);
-			maximum[i] = std::max(maximum[i], box->maximum[i]);
+			minimum[i] = std::min(minimum[i], box.minimum[i]);
+			maximum[i] = std::max(maximum[i], box.maximum[i]);
 		}
 	}
 
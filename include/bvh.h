@@ -9,76 +9,660 @@
 #define bvh_h
 
 #include <queue>
-#include <stack>
 #include <algorithm>
+#include <vector>
+#include <time.h>
 
 #include "common.h"
 #include "hittable.h"
+#include "triangle.h"
 
-struct bvh_node
+#if defined(USE_AVX2) || defined(USE_SSE)
+#include <immintrin.h>
+#endif
+
+// deeper nodes are turned into leaves, which bounds the traversal stacks
+const uint32_t bvh_max_depth = 64;
+
+// read only array traversed by the bvh, held by one of its vectors or mapped from a scene cache
+template <typename T>
+struct array_view
 {
-    aabb bounding;
-    bvh_node *left, *right;
-	uint32_t start = 0, end = 0;
+	const T* items = nullptr;
+	size_t count = 0;
+
+	array_view() {}
+	array_view(const std::vector<T>& v) : items(v.data()), count(v.size()) {}
+	array_view(const T* items, size_t count) : items(items), count(count) {}
+
+	inline const T& operator[](size_t i) const { return items[i]; }
+	inline size_t size() const { return count; }
+	inline bool empty() const { return count == 0; }
+	inline const T* data() const { return items; }
+};
+
+// node of the flattened tree, stored in depth-first order so the left child
+// of an interior node is the next node in the array
+struct alignas(32) bvh_node
+{
+	aabb bounding;
+	union
+	{
+		uint32_t prim_offset;	// leaf: first triangle block
+		uint32_t right_offset;	// interior: index of the right child
+	};
+	uint16_t prim_count;		// triangles of a leaf, 0 for interior nodes
+	uint8_t axis;				// split axis of interior nodes
+	uint8_t pad;
 
 	inline bool is_leaf() const 
 	{
-		return left == nullptr && right == nullptr;
+		return prim_count > 0;
+	}
+};
+
+#ifdef USE_FP32
+static_assert(sizeof(bvh_node) == 32, "bvh_node is expected to fill half a cache line");
+#endif
+
+// node of a 4 or 8 wide bvh collapsed from the binary tree,
+// child bounds are stored as soa so all children are tested at once
+template <int N>
+struct alignas(32) wide_bvh_node
+{
+	float bmin[3][N];
+	float bmax[3][N];
+	uint32_t child[N];		// wide node index, or first triangle block of a leaf child
+	uint16_t count[N];		// triangle count of leaf children, 0 for interior children
+	uint8_t child_count;
+};
+
+// ray data broadcast into the wide box tests
+struct wide_ray
+{
+	float origin[3];
+	float inv_direction[3];
+
+	wide_ray(const ray& r)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			origin[i] = static_cast<float>(r.origin[i]);
+			inv_direction[i] = static_cast<float>(r.inv_direction[i]);
+		}
+	}
+};
+
+// slab test of all children of a wide node, returns the mask of hit children
+template <int N>
+inline int intersect_children(const wide_bvh_node<N>& node, const wide_ray& r, float t_min, float t_max, float* t_near)
+{
+	int mask = 0;
+	for (int i = 0; i < node.child_count; i++)
+	{
+		float t0 = t_min, t1 = t_max;
+		for (int a = 0; a < 3; a++)
+		{
+			float near_t = (node.bmin[a][i] - r.origin[a]) * r.inv_direction[a];
+			float far_t = (node.bmax[a][i] - r.origin[a]) * r.inv_direction[a];
+			if (near_t > far_t)
+				std::swap(near_t, far_t);
+			t0 = near_t > t0 ? near_t : t0;
+			t1 = far_t < t1 ? far_t : t1;
+		}
+
+		t_near[i] = t0;
+		if (t0 <= t1)
+			mask |= 1 << i;
+	}
+
+	return mask;
+}
+
+#ifdef USE_SSE
+template <>
+inline int intersect_children<4>(const wide_bvh_node<4>& node, const wide_ray& r, float t_min, float t_max, float* t_near)
+{
+	__m128 t0 = _mm_set1_ps(t_min);
+	__m128 t1 = _mm_set1_ps(t_max);
+	for (int a = 0; a < 3; a++)
+	{
+		__m128 origin = _mm_set1_ps(r.origin[a]);
+		__m128 inv_direction = _mm_set1_ps(r.inv_direction[a]);
+		__m128 near_t = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[a]), origin), inv_direction);
+		__m128 far_t = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[a]), origin), inv_direction);
+		t0 = _mm_max_ps(_mm_min_ps(near_t, far_t), t0);
+		t1 = _mm_min_ps(_mm_max_ps(near_t, far_t), t1);
+	}
+
+	_mm_storeu_ps(t_near, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.child_count) - 1);
+}
+#endif
+
+#ifdef USE_AVX2
+template <>
+inline int intersect_children<8>(const wide_bvh_node<8>& node, const wide_ray& r, float t_min, float t_max, float* t_near)
+{
+	__m256 t0 = _mm256_set1_ps(t_min);
+	__m256 t1 = _mm256_set1_ps(t_max);
+	for (int a = 0; a < 3; a++)
+	{
+		__m256 origin = _mm256_set1_ps(r.origin[a]);
+		__m256 inv_direction = _mm256_set1_ps(r.inv_direction[a]);
+		__m256 near_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bmin[a]), origin), inv_direction);
+		__m256 far_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bmax[a]), origin), inv_direction);
+		t0 = _mm256_max_ps(_mm256_min_ps(near_t, far_t), t0);
+		t1 = _mm256_min_ps(_mm256_max_ps(near_t, far_t), t1);
+	}
+
+	_mm256_storeu_ps(t_near, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & ((1 << node.child_count) - 1);
+}
+#endif
+
+// coherent rays traversed together, stored as soa so one box is tested against all lanes at once
+template <int N>
+struct ray_packet
+{
+	static_assert(N <= 32, "lane masks are 32 bits wide");
+
+	alignas(32) float origin[3][N];
+	alignas(32) float inv_direction[3][N];
+	alignas(32) float t_max[N];
+	tri_ray tr[N];
+
+	float t_min;
+	uint32_t valid;		// lanes holding a ray
+	int sign[3];		// direction sign shared by most lanes, used to order the children
+
+	ray_packet(const ray* rays, int count, fType min_t, const fType* max_t)
+	{
+		t_min = static_cast<float>(min_t);
+		valid = 0;
+
+		int negative[3] = { 0, 0, 0 };
+		for (int i = 0; i < N; i++)
+		{
+			if (i < count)
+			{
+				for (int a = 0; a < 3; a++)
+				{
+					origin[a][i] = static_cast<float>(rays[i].origin[a]);
+					inv_direction[a][i] = static_cast<float>(rays[i].inv_direction[a]);
+					negative[a] += rays[i].sign[a];
+				}
+				t_max[i] = static_cast<float>(max_t[i]);
+				tr[i] = tri_ray(rays[i]);
+				valid |= 1u << i;
+			}
+			else
+			{
+				// empty lanes never hit a box
+				for (int a = 0; a < 3; a++)
+					origin[a][i] = inv_direction[a][i] = 0.0f;
+				t_max[i] = -1.0f;
+			}
+		}
+
+		for (int a = 0; a < 3; a++)
+			sign[a] = 2 * negative[a] > count ? 1 : 0;
 	}
 };
 
+// slab test of one box against every lane of a packet, returns the mask of lanes hitting it
+template <int N>
+inline uint32_t intersect_packet(const aabb& box, const ray_packet<N>& p)
+{
+	uint32_t mask = 0;
+#ifdef USE_AVX2
+	if constexpr (N % 8 == 0)
+	{
+		for (int g = 0; g < N; g += 8)
+		{
+			__m256 t0 = _mm256_set1_ps(p.t_min);
+			__m256 t1 = _mm256_load_ps(p.t_max + g);
+			for (int a = 0; a < 3; a++)
+			{
+				__m256 origin = _mm256_load_ps(p.origin[a] + g);
+				__m256 inv_direction = _mm256_load_ps(p.inv_direction[a] + g);
+				__m256 near_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(static_cast<float>(box.minimum[a])), origin), inv_direction);
+				__m256 far_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(static_cast<float>(box.maximum[a])), origin), inv_direction);
+				t0 = _mm256_max_ps(_mm256_min_ps(near_t, far_t), t0);
+				t1 = _mm256_min_ps(_mm256_max_ps(near_t, far_t), t1);
+			}
+			mask |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ))) << g;
+		}
+		return mask;
+	}
+#endif
+#ifdef USE_SSE
+	if constexpr (N % 4 == 0)
+	{
+		for (int g = 0; g < N; g += 4)
+		{
+			__m128 t0 = _mm_set1_ps(p.t_min);
+			__m128 t1 = _mm_load_ps(p.t_max + g);
+			for (int a = 0; a < 3; a++)
+			{
+				__m128 origin = _mm_load_ps(p.origin[a] + g);
+				__m128 inv_direction = _mm_load_ps(p.inv_direction[a] + g);
+				__m128 near_t = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(static_cast<float>(box.minimum[a])), origin), inv_direction);
+				__m128 far_t = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(static_cast<float>(box.maximum[a])), origin), inv_direction);
+				t0 = _mm_max_ps(_mm_min_ps(near_t, far_t), t0);
+				t1 = _mm_min_ps(_mm_max_ps(near_t, far_t), t1);
+			}
+			mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t0, t1))) << g;
+		}
+		return mask;
+	}
+#endif
+	for (int i = 0; i < N; i++)
+	{
+		float t0 = p.t_min, t1 = p.t_max[i];
+		for (int a = 0; a < 3; a++)
+		{
+			float near_t = (static_cast<float>(box.minimum[a]) - p.origin[a][i]) * p.inv_direction[a][i];
+			float far_t = (static_cast<float>(box.maximum[a]) - p.origin[a][i]) * p.inv_direction[a][i];
+			if (near_t > far_t)
+				std::swap(near_t, far_t);
+			t0 = near_t > t0 ? near_t : t0;
+			t1 = far_t < t1 ? far_t : t1;
+		}
+
+		if (t0 <= t1)
+			mask |= 1u << i;
+	}
+
+	return mask;
+}
+
 // triangle used in building bvh
 struct building_node
 {
-	shared_ptr<hittable> shape_ptr;
-	shared_ptr<aabb> bound_ptr;
+	uint32_t prim;
+	aabb bound;
 	vec3 center;
 };
 
+enum class bvh_split_method
+{
+	middle,	// spatial median of the centroid bounds
+	sah		// binned surface area heuristic
+};
+
+struct bvh_build_config
+{
+	bvh_split_method split_method = bvh_split_method::sah;
+
+	// max triangles per leaf, every leaf keeps to it since node counts are 16 bit
+	uint32_t leaf_capacity = 8;
+
+	// number of centroid bins per axis used by the sah builder
+	uint32_t bin_count = 16;
+
+	// cost of visiting an interior node and of intersecting one triangle
+	fType traversal_cost = 1.0;
+	fType leaf_cost = 1.0;
+
+	// branching factor used for traversal: 2 (binary), 4 (sse) or 8 (avx2)
+	uint32_t width = 2;
+};
+
+// everything the traversal needs, as written to and read from a scene cache
+struct bvh_arrays
+{
+	uint32_t width = 2;
+	fType sah_cost = 0.0;
+	uint32_t node_count = 0;
+	uint32_t leaf_count = 0;
+	aabb bounds;
+
+	array_view<tri_block> blocks;
+	array_view<bvh_node> nodes;
+	array_view<wide_bvh_node<4>> nodes4;
+	array_view<wide_bvh_node<8>> nodes8;
+};
+
 class bvh : public hittable
 {
 public:
-    bvh(const std::vector<shared_ptr<hittable>>& src_objects) 
+	// a tree built earlier, traversed in place. storage keeps the memory of the arrays alive
+	bvh(const bvh_arrays& arrays, std::shared_ptr<const void> storage)
+		: blocks(arrays.blocks), nodes(arrays.nodes), width(arrays.width), nodes4(arrays.nodes4), nodes8(arrays.nodes8), storage(storage)
+	{
+		aabb_ptr = make_shared<aabb>(arrays.bounds.minimum, arrays.bounds.maximum);
+		sah_cost = arrays.sah_cost;
+		node_count = arrays.node_count;
+		leaf_count = arrays.leaf_count;
+	}
+
+    bvh(const std::vector<tri_accel>& src_triangles, const std::vector<aabb>& src_bounds, const bvh_build_config& config = bvh_build_config()) 
     {
-        //aabb_ptr = make_shared<aabb>();
+        aabb_ptr = make_shared<aabb>();
 
-        int obj_count = src_objects.size();
+        uint32_t obj_count = src_triangles.size();
 		std::vector<building_node> build_nodes(obj_count);
 		for (uint32_t i = 0; i < obj_count; ++i)
 		{
             auto& build_node = build_nodes[i];
-			build_node.shape_ptr = src_objects[i];
-			build_node.bound_ptr = src_objects[i]->bounding_box();
-			build_node.center = (build_node.bound_ptr->max() + build_node.bound_ptr->min()) * 0.5;
-            //aabb_ptr->extand(build_shape.bound_ptr);
+			build_node.prim = i;
+			build_node.bound = src_bounds[i];
+			build_node.center = build_node.bound.center();
+            aabb_ptr->extand(build_node.bound);
 		}
 
-		const uint32_t leaf_capacity = 8;
-		build_bvh(build_nodes, leaf_capacity);
+		clock_t start_time = clock();
+		std::vector<building_tree_node> tree;
+		build_bvh(build_nodes, config, tree);
+
+		// pack the triangles of each leaf into blocks while laying the tree out depth first
+		uint32_t used_lanes = 0;
+		std::vector<tri_accel> ordered;
+		ordered.reserve(obj_count);
+		for (auto& bs : build_nodes)
+			ordered.push_back(src_triangles[bs.prim]);
+
+		node_storage.reserve(tree.size());
+		if (obj_count > 0)
+			flatten(tree, 0, ordered, used_lanes);
+		blocks = block_storage;
+		nodes = node_storage;
 
-		shape_ptrs.reserve(obj_count);
-		for (auto bs : build_nodes)
-			shape_ptrs.push_back(bs.shape_ptr);
+		double seconds = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+
+		INFO("bvh built with %s split in %.4fs: %u nodes, %u leaves, %u triangle blocks of %d, sah cost = %.3f",
+			config.split_method == bvh_split_method::sah ? "sah" : "middle",
+			static_cast<float>(seconds), node_count, leaf_count, (uint32_t)blocks.size(), tri_block_width, static_cast<float>(sah_cost));
+
+		width = config.width;
+		if (width == 4)
+		{
+			if (!nodes.empty())
+				collapse(node4_storage, 0);
+			nodes4 = node4_storage;
+			INFO("collapsed into %u bvh4 nodes", (uint32_t)nodes4.size());
+		}
+		else if (width == 8)
+		{
+#ifndef USE_AVX2
+			WARN("built without avx2, bvh8 boxes are tested with scalar code.");
+#endif
+			if (!nodes.empty())
+				collapse(node8_storage, 0);
+			nodes8 = node8_storage;
+			INFO("collapsed into %u bvh8 nodes", (uint32_t)nodes8.size());
+		}
+		else
+			width = 2;
+
+		// the binary nodes are only kept when they are traversed
+		if (width != 2)
+		{
+			std::vector<bvh_node>().swap(node_storage);
+			nodes = node_storage;
+		}
     }
 
 	virtual bool hit_fast(const ray& r, fType t_min, fType t_max) const override;
 	virtual bool hit(const ray& r, fType t_min, fType t_max, hit_cache& cache) const override;
 
+	// any hit query returning the triangle block that blocks the ray, or no_occluder
+	static constexpr uint32_t no_occluder = 0xFFFFFFFF;
+	uint32_t find_occluder(const ray& r, fType t_min, fType t_max) const;
+
+	// tests a single block, typically the occluder of a previous shadow ray
+	bool occluded_by(uint32_t block, const ray& r, fType t_min, fType t_max) const
+	{
+		return block < blocks.size() && hit_block_fast(blocks[block], tri_ray(r), t_min, t_max);
+	}
+
+	// traverse up to N coherent rays together on the binary tree, wider trees fall back to one ray at a time.
+	// returns the mask of lanes that hit something (hit_packet) or are occluded (hit_fast_packet)
+	template <int N>
+	uint32_t hit_packet(const ray* rays, int count, fType t_min, fType t_max, hit_cache* caches) const;
+	template <int N>
+	uint32_t hit_fast_packet(const ray* rays, int count, fType t_min, const fType* t_max) const;
+
+	bvh_arrays arrays() const
+	{
+		bvh_arrays result;
+		result.width = width;
+		result.sah_cost = sah_cost;
+		result.node_count = node_count;
+		result.leaf_count = leaf_count;
+		result.bounds = *aabb_ptr;
+		result.blocks = blocks;
+		result.nodes = nodes;
+		result.nodes4 = nodes4;
+		result.nodes8 = nodes8;
+		return result;
+	}
+
+	size_t memory_bytes() const
+	{
+		return blocks.size() * sizeof(tri_block) + nodes.size() * sizeof(bvh_node)
+			+ nodes4.size() * sizeof(wide_bvh_node<4>) + nodes8.size() * sizeof(wide_bvh_node<8>);
+	}
+
+	// expected cost of a random ray traversing the tree, relative to the root's surface area
+	fType sah_cost = 0.0;
+	uint32_t node_count = 0;
+	uint32_t leaf_count = 0;
+
 private:
-	std::vector<shared_ptr<hittable>> shape_ptrs;
-	bvh_node* bvh_root = nullptr;
+	array_view<tri_block> blocks;
+	array_view<bvh_node> nodes;
+
+	uint32_t width = 2;
+	array_view<wide_bvh_node<4>> nodes4;
+	array_view<wide_bvh_node<8>> nodes8;
+
+	// memory of the arrays above, filled by the build or a mapped scene cache
+	std::vector<tri_block> block_storage;
+	std::vector<bvh_node> node_storage;
+	std::vector<wide_bvh_node<4>> node4_storage;
+	std::vector<wide_bvh_node<8>> node8_storage;
+	std::shared_ptr<const void> storage;
+
+	static inline uint32_t block_count(uint32_t triangle_count)
+	{
+		return (triangle_count + tri_block_width - 1) / tri_block_width;
+	}
+
+	template <int N>
+	const array_view<wide_bvh_node<N>>& wide_nodes() const;
+
+	template <int N>
+	uint32_t find_occluder_wide(const ray& r, fType t_min, fType t_max) const;
+	template <int N>
+	bool hit_wide(const ray& r, fType t_min, fType t_max, hit_cache& cache) const;
 
-	void build_bvh(std::vector<building_node>& shapes, uint32_t leaf_capacity)
+	// node of the temporary tree produced by build_bvh
+	struct building_tree_node
+	{
+		aabb bounding;
+		uint32_t left = 0, right = 0;
+		uint32_t start = 0, end = 0;
+		int axis = 0;
+	};
+
+	// returns the split position in [start, end), or start when a leaf is cheaper
+	uint32_t split_middle(std::vector<building_node>& shapes, uint32_t start, uint32_t end, uint32_t depth, const aabb& center_bound, int& axis)
+	{
+		uint32_t tri_num = end - start;
+
+		// split alone the longest axis
+		vec3 center_bound_size = center_bound.size();
+		int split_axis = center_bound_size.x > center_bound_size.y ?
+			(center_bound_size.x > center_bound_size.z ? 0 : 2) :
+			(center_bound_size.y > center_bound_size.z ? 1 : 2);
+		axis = split_axis;
+
+		uint32_t middle;
+		if (depth < 64)
+		{
+			fType split_value = 0.5 * (center_bound.maximum[split_axis] + center_bound.minimum[split_axis]);
+			middle = start;
+
+			for (uint32_t i = start; i < end; i++)
+			{
+				if (shapes[i].center[split_axis] < split_value)
+					std::swap(shapes[i], shapes[middle++]);
+			}
+
+			//bad split
+			if (middle == start || middle == end)
+				middle = start + tri_num / 2;
+		}
+		else
+		{
+			//divide with triangle count when depth is too large
+			std::sort(shapes.begin() + start, shapes.begin() + end,
+				[axis = split_axis](const building_node& a, const building_node& b)
+				{
+					return a.center[axis] < b.center[axis];
+				});
+			middle = start + tri_num / 2;
+		}
+
+		return middle;
+	}
+
+	// halves the triangles at the median center of the longest axis
+	uint32_t split_count(std::vector<building_node>& shapes, uint32_t start, uint32_t end, const aabb& center_bound, int& axis)
+	{
+		vec3 size = center_bound.size();
+		axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+		uint32_t middle = start + (end - start) / 2;
+		std::nth_element(shapes.begin() + start, shapes.begin() + middle, shapes.begin() + end,
+			[a = axis](const building_node& l, const building_node& r)
+			{
+				return l.center[a] < r.center[a];
+			});
+		return middle;
+	}
+
+	// levels of splits by count that bring tri_num down to capacity
+	static uint32_t count_split_levels(uint32_t tri_num, uint32_t capacity)
+	{
+		uint32_t levels = 0;
+		for (; tri_num > capacity; tri_num = (tri_num + 1) / 2)
+			levels++;
+		return levels;
+	}
+
+	// binned sah split (Wald 2007), evaluated on all three axes
+	uint32_t split_sah(std::vector<building_node>& shapes, uint32_t start, uint32_t end, const aabb& all_bound, const aabb& center_bound, const bvh_build_config& config, int& axis)
+	{
+		struct Bin
+		{
+			aabb bound;
+			uint32_t count = 0;
+		};
+
+		const uint32_t bin_count = std::max(2u, config.bin_count);
+		uint32_t tri_num = end - start;
+
+		std::vector<Bin> bins(bin_count);
+		std::vector<fType> right_area(bin_count);
+		std::vector<uint32_t> right_count(bin_count);
+
+		fType best_cost = std::numeric_limits<fType>::max();
+		int best_axis = -1;
+		uint32_t best_bin = 0;
+
+		vec3 center_size = center_bound.size();
+		for (int axis = 0; axis < 3; axis++)
+		{
+			fType extent = center_size[axis];
+			if (extent <= 0)
+				continue;
+
+			fType scale = bin_count / extent;
+			for (auto& bin : bins)
+				bin = Bin();
+
+			for (uint32_t i = start; i < end; i++)
+			{
+				uint32_t b = std::min(bin_count - 1, static_cast<uint32_t>((shapes[i].center[axis] - center_bound.minimum[axis]) * scale));
+				bins[b].bound.extand(shapes[i].bound);
+				bins[b].count++;
+			}
+
+			// sweep from the right to get the area and count of each right side
+			aabb right_bound;
+			uint32_t count = 0;
+			for (uint32_t b = bin_count - 1; b > 0; b--)
+			{
+				right_bound.extand(bins[b].bound);
+				count += bins[b].count;
+				right_area[b] = right_bound.surface_area();
+				right_count[b] = count;
+			}
+
+			// sweep from the left, splitting between bin b - 1 and bin b
+			aabb left_bound;
+			count = 0;
+			for (uint32_t b = 1; b < bin_count; b++)
+			{
+				left_bound.extand(bins[b - 1].bound);
+				count += bins[b - 1].count;
+				if (count == 0 || right_count[b] == 0)
+					continue;
+
+				fType cost = left_bound.surface_area() * count + right_area[b] * right_count[b];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = b;
+				}
+			}
+		}
+
+		// all centers coincide, only a split by count is possible
+		axis = 0;
+		if (best_axis < 0)
+			return tri_num <= config.leaf_capacity ? start : start + tri_num / 2;
+
+		fType parent_area = all_bound.surface_area();
+		best_cost = config.traversal_cost + (parent_area > 0 ? best_cost / parent_area : tri_num) * config.leaf_cost;
+		if (tri_num <= config.leaf_capacity && best_cost >= tri_num * config.leaf_cost)
+			return start;
+
+		axis = best_axis;
+		fType scale = bin_count / center_size[best_axis];
+		fType minimum = center_bound.minimum[best_axis];
+		auto middle = std::partition(shapes.begin() + start, shapes.begin() + end,
+			[&](const building_node& node)
+			{
+				uint32_t b = std::min(bin_count - 1, static_cast<uint32_t>((node.center[best_axis] - minimum) * scale));
+				return b < best_bin;
+			});
+
+		return static_cast<uint32_t>(middle - shapes.begin());
+	}
+
+	void build_bvh(std::vector<building_node>& shapes, const bvh_build_config& config, std::vector<building_tree_node>& tree)
 	{
 		struct BuildingTask
 		{
-			bvh_node** fillback;
+			uint32_t node;
 			uint32_t start, end;
 			uint32_t depth;
 		};
 
+		tree.assign(1, building_tree_node());
+		tree.reserve(2 * shapes.size() / std::max(1u, config.leaf_capacity) + 1);
+
 		std::queue<BuildingTask> tasks;
-		tasks.push({ &bvh_root, 0, (uint32_t)shapes.size(), 0 });
+		tasks.push({ 0, 0, (uint32_t)shapes.size(), 0 });
+
+		fType root_area = 0.0;
+		sah_cost = 0.0;
+		node_count = leaf_count = 0;
 
 		while (!tasks.empty())
 		{
@@ -89,155 +673,630 @@ private:
 			for (int i = task.start; i < task.end; i++)
 			{
 				auto& tri = shapes[i];
-				all_bound.extand(tri.bound_ptr);
+				all_bound.extand(tri.bound);
 				center_bound.extand(tri.center);
 			}
 
-			// construct leaf node when triangle count is sufficiently low
+			if (task.depth == 0)
+				root_area = all_bound.surface_area();
+			fType area_ratio = root_area > 0 ? all_bound.surface_area() / root_area : 1.0;
+
+			node_count++;
+
 			uint32_t tri_num = task.end - task.start;
-			if (tri_num <= leaf_capacity)
-			{
-				//TODO use mem pool
-				auto leaf = new bvh_node();
+			uint32_t middle = task.start;
+			int axis = 0;
+			// a leaf at the depth cap still has to fit leaf_capacity (and the 16 bit counts of the nodes), so
+			// once the levels left are only enough for halving the triangles, they are split by count
+			const uint32_t capacity = std::max(1u, config.leaf_capacity);
+			if (task.depth + 1 >= bvh_max_depth)
+				middle = task.start;
+			else if (task.depth + 1 + count_split_levels(tri_num, capacity) >= bvh_max_depth)
+				middle = split_count(shapes, task.start, task.end, center_bound, axis);
+			else if (config.split_method == bvh_split_method::sah)
+				middle = split_sah(shapes, task.start, task.end, all_bound, center_bound, config, axis);
+			else if (tri_num > config.leaf_capacity)
+				middle = split_middle(shapes, task.start, task.end, task.depth, center_bound, axis);
+
+			building_tree_node& node = tree[task.node];
+			node.bounding = all_bound;
+			node.axis = axis;
 
-				leaf->bounding = all_bound;
-				leaf->left = nullptr;
-				leaf->right = nullptr;
-				leaf->start = task.start;
-				leaf->end = task.end;
+			// construct leaf node when triangle count is sufficiently low
+			if (middle == task.start || middle == task.end)
+			{
+				node.start = task.start;
+				node.end = task.end;
 
-				*task.fillback = leaf;
+				leaf_count++;
+				sah_cost += area_ratio * tri_num * config.leaf_cost;
 				continue;
 			}
 
-			// split alone the longest axis
-			vec3 center_bound_size = center_bound.size();
-			int split_axis = center_bound_size.x > center_bound_size.y ?
-				(center_bound_size.x > center_bound_size.z ? 0 : 2) :
-				(center_bound_size.y > center_bound_size.z ? 1 : 2);
+			sah_cost += area_ratio * config.traversal_cost;
+
+			uint32_t left = tree.size();
+			node.left = left;
+			node.right = left + 1;
+			tree.resize(tree.size() + 2);
+
+			tasks.push({ left, task.start, middle, task.depth + 1 });
+			tasks.push({ left + 1, middle, task.end, task.depth + 1 });
+		}
+	}
+
+	// used_lanes counts the lanes filled in the last block, 0 once it is full. a leaf that fits in the
+	// lanes left shares the block with the leaves before it, so sah sized leaves of a few triangles do
+	// not leave most lanes empty. a leaf then also tests its neighbours' triangles, which costs the
+	// simd kernels nothing and only ever reports real hits
+	uint32_t flatten(const std::vector<building_tree_node>& tree, uint32_t index, const std::vector<tri_accel>& ordered, uint32_t& used_lanes)
+	{
+		const building_tree_node& src = tree[index];
+
+		uint32_t offset = node_storage.size();
+		node_storage.emplace_back();
+		node_storage[offset].bounding = src.bounding;
+		node_storage[offset].axis = static_cast<uint8_t>(src.axis);
+		node_storage[offset].pad = 0;
 
-			uint32_t middle;
-			if (task.depth < 64)
+		if (src.left == 0)
+		{
+			uint32_t count = src.end - src.start;
+			uint32_t lane = used_lanes + count > tri_block_width ? 0 : used_lanes;
+			node_storage[offset].prim_offset = lane == 0 ? block_storage.size() : block_storage.size() - 1;
+			node_storage[offset].prim_count = static_cast<uint16_t>(count);
+
+			for (uint32_t i = src.start; i < src.end; i++)
 			{
-				fType split_value = 0.5 * (center_bound.maximum[split_axis] + center_bound.minimum[split_axis]);
-				middle = task.start;
+				if (lane == 0)
+				{
+					block_storage.emplace_back();
+					block_storage.back().clear();
+				}
+				block_storage.back().set(lane, ordered[i]);
+				lane = (lane + 1) % tri_block_width;
+			}
+			used_lanes = lane;
+		}
+		else
+		{
+			node_storage[offset].prim_count = 0;
+			flatten(tree, src.left, ordered, used_lanes);
+			node_storage[offset].right_offset = flatten(tree, src.right, ordered, used_lanes);
+		}
 
-				for (uint32_t i = task.start; i < task.end; i++)
+		return offset;
+	}
+
+	// collapse the binary subtree at nodes[index] into one wide node by
+	// repeatedly opening the interior child with the largest surface area
+	template <int N>
+	uint32_t collapse(std::vector<wide_bvh_node<N>>& wide, uint32_t index)
+	{
+		uint32_t children[N];
+		int child_count = 0;
+
+		const bvh_node& root = nodes[index];
+		if (root.is_leaf())
+			children[child_count++] = index;
+		else
+		{
+			children[child_count++] = index + 1;
+			children[child_count++] = root.right_offset;
+		}
+
+		while (child_count < N)
+		{
+			int best = -1;
+			fType best_area = -1.0;
+			for (int i = 0; i < child_count; i++)
+			{
+				const bvh_node& child = nodes[children[i]];
+				if (!child.is_leaf() && child.bounding.surface_area() > best_area)
 				{
-					if (shapes[i].center[split_axis] < split_value)
-						std::swap(shapes[i], shapes[middle++]);
+					best = i;
+					best_area = child.bounding.surface_area();
 				}
+			}
+
+			if (best < 0)
+				break;
 
-				//bad split
-				if (middle == task.start || middle == task.end)
-					middle = task.start + tri_num / 2;
+			uint32_t opened = children[best];
+			children[best] = opened + 1;
+			children[child_count++] = nodes[opened].right_offset;
+		}
+
+		uint32_t offset = wide.size();
+		wide.emplace_back();
+
+		wide_bvh_node<N>& node = wide[offset];
+		node.child_count = static_cast<uint8_t>(child_count);
+		for (int i = 0; i < N; i++)
+		{
+			// empty slots are masked out by child_count
+			bool used = i < child_count;
+			for (int a = 0; a < 3; a++)
+			{
+				node.bmin[a][i] = used ? static_cast<float>(nodes[children[i]].bounding.minimum[a]) : 0.0f;
+				node.bmax[a][i] = used ? static_cast<float>(nodes[children[i]].bounding.maximum[a]) : 0.0f;
 			}
-			else
+			node.child[i] = used ? nodes[children[i]].prim_offset : 0;
+			node.count[i] = used ? nodes[children[i]].prim_count : 0;
+		}
+
+		// wide may grow while the children are collapsed
+		for (int i = 0; i < child_count; i++)
+		{
+			if (!nodes[children[i]].is_leaf())
 			{
-				//divide with triangle count when depth is too large
-				std::sort(shapes.begin() + task.start, shapes.begin() + task.end,
-					[axis = split_axis](const building_node& a, const building_node& b)
-					{
-						return a.center[axis] < b.center[axis];
-					});
-				middle = task.start + tri_num / 2;
+				uint32_t child = collapse(wide, children[i]);
+				wide[offset].child[i] = child;
+			}
+		}
+
+		return offset;
+	}
+};
+
+template <>
+inline const array_view<wide_bvh_node<4>>& bvh::wide_nodes<4>() const
+{
+	return nodes4;
+}
+
+template <>
+inline const array_view<wide_bvh_node<8>>& bvh::wide_nodes<8>() const
+{
+	return nodes8;
+}
+
+// entry of the wide traversal stacks, either a wide node or a leaf's primitive range
+struct wide_stack_entry
+{
+	uint32_t index;
+	uint32_t count;
+	float t;
+};
+
+template <int N>
+uint32_t bvh::find_occluder_wide(const ray& r, fType t_min, fType t_max) const
+{
+	const array_view<wide_bvh_node<N>>& wide = wide_nodes<N>();
+	if (wide.empty())
+		return no_occluder;
+
+	wide_ray wr(r);
+	tri_ray tr(r);
+	wide_stack_entry stack[(N - 1) * bvh_max_depth + 1];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, static_cast<float>(t_min) };
+
+	alignas(32) float t_near[N];
+	while (stack_size > 0)
+	{
+		wide_stack_entry entry = stack[--stack_size];
+		if (entry.count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + block_count(entry.count); i++)
+			{
+				if (hit_block_fast(blocks[i], tr, t_min, t_max))
+					return i;
+			}
+			continue;
+		}
+
+		const wide_bvh_node<N>& node = wide[entry.index];
+		int mask = intersect_children<N>(node, wr, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+		for (int i = 0; i < N; i++)
+		{
+			if (mask & (1 << i))
+				stack[stack_size++] = { node.child[i], node.count[i], t_near[i] };
+		}
+	}
+
+	return no_occluder;
+}
+
+template <int N>
+bool bvh::hit_wide(const ray& r, fType t_min, fType t_max, hit_cache& cache) const
+{
+	const array_view<wide_bvh_node<N>>& wide = wide_nodes<N>();
+	if (wide.empty())
+		return false;
+
+	bool hit_anything = false;
+
+	wide_ray wr(r);
+	tri_ray tr(r);
+	wide_stack_entry stack[(N - 1) * bvh_max_depth + 1];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, static_cast<float>(t_min) };
+
+	alignas(32) float t_near[N];
+	while (stack_size > 0)
+	{
+		wide_stack_entry entry = stack[--stack_size];
+
+		// t_max may have shrunk since this entry was pushed
+		if (entry.t > t_max)
+			continue;
+
+		if (entry.count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + block_count(entry.count); i++)
+			{
+				if (hit_block(blocks[i], tr, t_min, t_max, cache))
+					hit_anything = true;
 			}
+			continue;
+		}
 
-			//TODO use mem pool
-			auto interior = new bvh_node();
-			interior->bounding = all_bound;
-			interior->left = nullptr;
-			interior->right = nullptr;
-			interior->start = 0;
-			interior->end = 0;
+		const wide_bvh_node<N>& node = wide[entry.index];
+		int mask = intersect_children<N>(node, wr, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+		if (mask == 0)
+			continue;
 
-			*task.fillback = interior;
+		// sort the hit children far to near, so the nearest one is popped first
+		int order[N];
+		int hit_count = 0;
+		for (int i = 0; i < N; i++)
+		{
+			if (!(mask & (1 << i)))
+				continue;
 
-			tasks.push({ &interior->left, task.start, middle, task.depth + 1 });
-			tasks.push({ &interior->right, middle, task.end, task.depth + 1 });
+			int j = hit_count++;
+			while (j > 0 && t_near[order[j - 1]] < t_near[i])
+			{
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = i;
+		}
+
+		for (int j = 0; j < hit_count; j++)
+		{
+			int i = order[j];
+			stack[stack_size++] = { node.child[i], node.count[i], t_near[i] };
 		}
 	}
-};
+
+	return hit_anything;
+}
 
 bool bvh::hit_fast(const ray& r, fType t_min, fType t_max) const
 {
-	thread_local std::stack<bvh_node*> node_stack;
-	node_stack.push(bvh_root);
+	return find_occluder(r, t_min, t_max) != no_occluder;
+}
+
+uint32_t bvh::find_occluder(const ray& r, fType t_min, fType t_max) const
+{
+	if (width == 4)
+		return find_occluder_wide<4>(r, t_min, t_max);
+	if (width == 8)
+		return find_occluder_wide<8>(r, t_min, t_max);
+
+	if (nodes.empty() || !nodes[0].bounding.hit(r, t_min, t_max))
+		return no_occluder;
 
-	while (!node_stack.empty())
+	tri_ray tr(r);
+	uint32_t stack[bvh_max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+
+	while (true)
 	{
-		bvh_node* node = node_stack.top();
-		node_stack.pop();
+		const bvh_node& node = nodes[current];
+		if (node.is_leaf())
+		{
+			for (uint32_t i = node.prim_offset; i < node.prim_offset + block_count(node.prim_count); i++)
+			{
+				if (hit_block_fast(blocks[i], tr, t_min, t_max))
+					return i;
+			}
 
-		if (!node || !node->bounding.hit(r, t_min, t_max))
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
 			continue;
+		}
+
+		uint32_t left = current + 1, right = node.right_offset;
+		bool hit_left = nodes[left].bounding.hit(r, t_min, t_max);
+		bool hit_right = nodes[right].bounding.hit(r, t_min, t_max);
 
-		if (node->is_leaf())
+		if (hit_left && hit_right)
 		{
-			for (uint32_t i = node->start; i < node->end; i++)
+			stack[stack_size++] = right;
+			current = left;
+		}
+		else if (hit_left || hit_right)
+			current = hit_left ? left : right;
+		else
+		{
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
+		}
+	}
+
+	return no_occluder;
+}
+
+bool bvh::hit(const ray& r, fType t_min, fType t_max, hit_cache& cache) const
+{
+	if (width == 4)
+		return hit_wide<4>(r, t_min, t_max, cache);
+	if (width == 8)
+		return hit_wide<8>(r, t_min, t_max, cache);
+
+	fType t_root;
+	if (nodes.empty() || !nodes[0].bounding.hit(r, t_min, t_max, t_root))
+		return false;
+
+	bool hit_anything = false;
+
+	// each entry keeps the distance at which the ray enters the node,
+	// so nodes behind the closest hit found so far are skipped without a box test
+	struct StackEntry
+	{
+		uint32_t index;
+		fType t;
+	};
+
+	tri_ray tr(r);
+	StackEntry stack[bvh_max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		const bvh_node& node = nodes[current];
+		if (node.is_leaf())
+		{
+			for (uint32_t i = node.prim_offset; i < node.prim_offset + block_count(node.prim_count); i++)
 			{
-				shared_ptr<hittable> shape = shape_ptrs[i];
-				if (shape && shape->hit_fast(r, t_min, t_max))
-					return true;
+				if (hit_block(blocks[i], tr, t_min, t_max, cache))
+					hit_anything = true;
 			}
 		}
 		else
 		{
-			bvh_node* left = node->left;
-			if (left && left->bounding.hit(r, t_min, t_max))
-				node_stack.push(left);
+			uint32_t left = current + 1, right = node.right_offset;
+			fType t_left, t_right;
+			bool hit_left = nodes[left].bounding.hit(r, t_min, t_max, t_left);
+			bool hit_right = nodes[right].bounding.hit(r, t_min, t_max, t_right);
 
-			bvh_node* right = node->right;
-			if (right && right->bounding.hit(r, t_min, t_max))
-				node_stack.push(right);
+			if (hit_left && hit_right)
+			{
+				// visit the nearer child first, the other one waits on the stack
+				if (t_right < t_left)
+				{
+					stack[stack_size++] = { left, t_left };
+					current = right;
+				}
+				else
+				{
+					stack[stack_size++] = { right, t_right };
+					current = left;
+				}
+				continue;
+			}
+			else if (hit_left || hit_right)
+			{
+				current = hit_left ? left : right;
+				continue;
+			}
 		}
+
+		// pop the next node that still lies in front of the closest hit
+		while (stack_size > 0 && stack[stack_size - 1].t > t_max)
+			stack_size--;
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size].index;
 	}
 
-	return false;
+	return hit_anything;
 }
 
-bool bvh::hit(const ray& r, fType t_min, fType t_max, hit_cache& cache) const
+
+// entry of the packet traversal stack, a node and the lanes that entered it
+struct packet_stack_entry
 {
-	hit_cache temp_cache;
-	thread_local std::stack<bvh_node*> node_stack;
-	node_stack.push(bvh_root);
+	uint32_t index;
+	uint32_t mask;
+};
 
-	while (!node_stack.empty())
+template <int N>
+uint32_t bvh::hit_packet(const ray* rays, int count, fType t_min, fType t_max, hit_cache* caches) const
+{
+	uint32_t hits = 0;
+	if (width != 2)
 	{
-		bvh_node* node = node_stack.top();
-		node_stack.pop();
+		for (int i = 0; i < count; i++)
+		{
+			if (hit(rays[i], t_min, t_max, caches[i]))
+				hits |= 1u << i;
+		}
+		return hits;
+	}
 
-		if (!node || !node->bounding.hit(r, t_min, t_max))
-			continue;
+	fType max_t[N];
+	for (int i = 0; i < N; i++)
+		max_t[i] = t_max;
+
+	ray_packet<N> p(rays, count, t_min, max_t);
+	if (nodes.empty())
+		return 0;
+
+	uint32_t mask = intersect_packet<N>(nodes[0].bounding, p) & p.valid;
+	if (mask == 0)
+		return 0;
 
-		if (node->is_leaf())
+	packet_stack_entry stack[bvh_max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		const bvh_node& node = nodes[current];
+		if (node.is_leaf())
 		{
-			for (uint32_t i = node->start; i < node->end; i++)
+			for (uint32_t i = node.prim_offset; i < node.prim_offset + block_count(node.prim_count); i++)
 			{
-				shared_ptr<hittable> shape = shape_ptrs[i];
-				if (shape && shape->hit(r, t_min, t_max, temp_cache))
+				for (int l = 0; l < N; l++)
 				{
-					cache = temp_cache;
-					t_max = temp_cache.t;
+					if (!(mask & (1u << l)))
+						continue;
+
+					fType t = p.t_max[l];
+					if (hit_block(blocks[i], p.tr[l], t_min, t, caches[l]))
+					{
+						p.t_max[l] = static_cast<float>(t);
+						hits |= 1u << l;
+					}
 				}
 			}
 		}
 		else
 		{
-			bvh_node* left = node->left;
-			if (left && left->bounding.hit(r, t_min, t_max))
-				node_stack.push(left);
+			uint32_t left = current + 1, right = node.right_offset;
+			uint32_t mask_left = intersect_packet<N>(nodes[left].bounding, p) & mask;
+			uint32_t mask_right = intersect_packet<N>(nodes[right].bounding, p) & mask;
 
-			bvh_node* right = node->right;
-			if (right && right->bounding.hit(r, t_min, t_max))
-				node_stack.push(right);
+			if (mask_left && mask_right)
+			{
+				// most lanes travel along the split axis in the same direction, visit that side first
+				if (p.sign[node.axis])
+				{
+					stack[stack_size++] = { left, mask_left };
+					current = right;
+					mask = mask_right;
+				}
+				else
+				{
+					stack[stack_size++] = { right, mask_right };
+					current = left;
+					mask = mask_left;
+				}
+				continue;
+			}
+			else if (mask_left || mask_right)
+			{
+				current = mask_left ? left : right;
+				mask = mask_left ? mask_left : mask_right;
+				continue;
+			}
 		}
+
+		// lanes whose closest hit now lies in front of a stacked node drop out of it
+		mask = 0;
+		while (stack_size > 0)
+		{
+			packet_stack_entry entry = stack[--stack_size];
+			mask = intersect_packet<N>(nodes[entry.index].bounding, p) & entry.mask;
+			if (mask)
+			{
+				current = entry.index;
+				break;
+			}
+		}
+
+		if (mask == 0)
+			break;
 	}
 
-	if(cache.t < t_min || cache.t > t_max)
-		return false;
+	return hits;
+}
+
+template <int N>
+uint32_t bvh::hit_fast_packet(const ray* rays, int count, fType t_min, const fType* t_max) const
+{
+	uint32_t occluded = 0;
+	if (width != 2)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (hit_fast(rays[i], t_min, t_max[i]))
+				occluded |= 1u << i;
+		}
+		return occluded;
+	}
+
+	ray_packet<N> p(rays, count, t_min, t_max);
+	if (nodes.empty())
+		return 0;
+
+	// lanes leave the packet as soon as they are occluded
+	uint32_t alive = p.valid;
+	uint32_t mask = intersect_packet<N>(nodes[0].bounding, p) & alive;
+	if (mask == 0)
+		return 0;
+
+	packet_stack_entry stack[bvh_max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		const bvh_node& node = nodes[current];
+		if (node.is_leaf())
+		{
+			for (uint32_t i = node.prim_offset; i < node.prim_offset + block_count(node.prim_count); i++)
+			{
+				for (int l = 0; l < N; l++)
+				{
+					if ((mask & alive & (1u << l)) && hit_block_fast(blocks[i], p.tr[l], t_min, t_max[l]))
+					{
+						occluded |= 1u << l;
+						alive &= ~(1u << l);
+					}
+				}
+			}
+
+			if (alive == 0)
+				break;
+		}
+		else
+		{
+			uint32_t left = current + 1, right = node.right_offset;
+			uint32_t mask_left = intersect_packet<N>(nodes[left].bounding, p) & mask & alive;
+			uint32_t mask_right = intersect_packet<N>(nodes[right].bounding, p) & mask & alive;
+
+			if (mask_left && mask_right)
+			{
+				stack[stack_size++] = { right, mask_right };
+				current = left;
+				mask = mask_left;
+				continue;
+			}
+			else if (mask_left || mask_right)
+			{
+				current = mask_left ? left : right;
+				mask = mask_left ? mask_left : mask_right;
+				continue;
+			}
+		}
+
+		mask = 0;
+		while (stack_size > 0)
+		{
+			packet_stack_entry entry = stack[--stack_size];
+			mask = entry.mask & alive;
+			if (mask)
+			{
+				current = entry.index;
+				break;
+			}
+		}
+
+		if (mask == 0)
+			break;
+	}
 
-	return true;
+	return occluded;
 }
 
 #endif /* bvh_h */
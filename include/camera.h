@@ -32,14 +32,36 @@ public:
         low_left_corner = origin - horizontal/2 - vertical/2 - focus_dist*w;
 
         lens_radius = aperture / 2;
+        pixel_dx = pixel_dy = vec3(0, 0, 0);
+    }
+
+    // gives the rays of get_ray the spread of a pixel, without it they are thin and textures are
+    // looked up at full resolution
+    void set_image_size(int image_width, int image_height)
+    {
+        pixel_dx = horizontal / image_width;
+        pixel_dy = vertical / image_height;
     }
     
     ray get_ray(fType s, fType t) const
     {
-        vec3 rd = lens_radius * random_in_unit_disk();
+        // a pinhole camera spends no random numbers on the lens
+        vec3 rd = lens_radius > 0 ? lens_radius * random_in_unit_disk() : vec3(0, 0, 0);
         vec3 offset = u * rd.x + v * rd.y;
 
-        return ray(origin + offset, (low_left_corner + s * horizontal + t * vertical - origin - offset).unit_vector());
+        vec3 dir = low_left_corner + s * horizontal + t * vertical - origin - offset;
+        ray r(origin + offset, dir.unit_vector());
+
+        // the differential rays through the next pixel over and up, the cone spreads by the
+        // larger of the angles to them
+        if (!pixel_dx.near_zero())
+        {
+            fType spread_x = ((dir + pixel_dx).unit_vector() - r.direction).length();
+            fType spread_y = ((dir + pixel_dy).unit_vector() - r.direction).length();
+            r.cone_spread = std::max(spread_x, spread_y);
+        }
+
+        return r;
     }
     
 public:
@@ -49,6 +71,8 @@ public:
     vec3 vertical;
     vec3 u, v, w;
     fType lens_radius;
+    // one pixel across and up on the focus plane, zero until set_image_size
+    vec3 pixel_dx, pixel_dy;
 };
 
 #endif /* camera_h */
@@ -12,10 +12,21 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
-#include <random>
+#include <cstdint>
+
+#include "sampler.h"
 
 #define USE_FP32
 
+// simd paths, enabled by the compiler's target flags (see RAGNAROK_AVX2 in CMakeLists.txt)
+#if defined(__AVX2__)
+#define USE_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE
+#endif
+
 #ifdef _MSC_VER
 #define FN_NAME __FUNCTION__
 #else
@@ -88,13 +99,44 @@ inline int clamp(int x, int min, int max)
     return x;
 }
 
+//every random number is drawn through the calling thread's sampler, an xoshiro128+ stream unless a
+//sample was started with a low discrepancy sampler
+inline path_sampler& thread_sampler()
+{
+	static thread_local path_sampler s;
+	return s;
+}
+
+//restart the calling thread's random sequence as a plain independent stream
+inline void random_seed(uint32_t seed)
+{
+	thread_sampler().start_stream(seed);
+}
+
+//seed of the random stream of one sample of one pixel, successive draws from it are the sample's
+//dimensions. stream tells apart independent parts of a sample that are not drawn in one sequence
+inline uint32_t sample_seed(uint32_t pixel, uint32_t sample, uint32_t stream = 0)
+{
+	uint64_t z = mix_bits((((uint64_t)pixel << 32) | sample) + 0x9E3779B97F4A7C15ull);
+	return static_cast<uint32_t>(mix_bits(z ^ stream));
+}
+
+//begin sample number sample of a pixel with default_sampler
+inline void start_sample(uint32_t pixel, uint32_t sample)
+{
+	thread_sampler().start_sample(default_sampler, pixel, sample, sample_seed(pixel, sample));
+}
+
+//move the current sample on to the dimensions of path vertex number vertex
+inline void start_vertex(int vertex)
+{
+	thread_sampler().start_vertex(vertex);
+}
+
 //return a random real in [0,1)
 inline fType random_value()
 {
-	static thread_local std::default_random_engine e;
-	static thread_local std::uniform_real_distribution<fType> distribution(static_cast<fType>(0.0), static_cast<fType>(1.0));
-
-    return distribution(e);
+	return thread_sampler().next();
 }
 
 //return a random real in [min,max)
@@ -29,11 +29,14 @@ struct hit_record
 {
     point3 p;
     vec3 normal;
-    shared_ptr<hittable> shape_ptr;
-    shared_ptr<material> mat_ptr;
+    // plain pointers into objects owned by the scene, copying a record never touches a refcount
+    const hittable* shape_ptr;
+    const material* mat_ptr;
 
     fType t;
     vec2 uv;
+    // width of the ray's cone at p measured in uv units, textures pick their mip level from it
+    fType footprint = 0.0;
 
     bool front_face;
     bool hit_light;
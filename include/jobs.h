@@ -0,0 +1,210 @@
+#pragma once
+
+#include "common.h"
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+// work of the startup, run by a pool of threads as soon as the jobs it depends on are done. a job
+// may add more jobs while it runs, like the obj parse adding one weld per shape. every job is timed
+// so print_timeline can show which stages overlapped
+class job_graph
+{
+public:
+	using job_id = size_t;
+	static constexpr job_id none = ~size_t(0);
+
+	job_graph(unsigned thread_count = std::thread::hardware_concurrency())
+	{
+		origin = clock::now();
+		for (unsigned t = 0; t < std::max(1u, thread_count); t++)
+			workers.emplace_back([this] { work(); });
+	}
+
+	~job_graph()
+	{
+		wait();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		ready_cv.notify_all();
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+
+	// stage names the row of the job in the timeline, dependencies equal to none are left out
+	job_id add(const std::string& stage, std::function<void()> work, const std::vector<job_id>& dependencies = {})
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job_id id = jobs.size();
+		jobs.emplace_back();
+		job& j = jobs.back();
+		j.stage = stage;
+		j.work = std::move(work);
+		for (job_id d : dependencies)
+		{
+			if (d != none && !jobs[d].done)
+			{
+				jobs[d].dependents.push_back(id);
+				j.waiting++;
+			}
+		}
+
+		unfinished++;
+		if (j.waiting == 0)
+		{
+			ready.push_back(id);
+			ready_cv.notify_one();
+		}
+		return id;
+	}
+
+	// runs work on the calling thread, it shows up in the timeline like a job
+	void run(const std::string& stage, const std::function<void()>& work)
+	{
+		clock::time_point start = clock::now();
+		work();
+		clock::time_point end = clock::now();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.emplace_back();
+		job& j = jobs.back();
+		j.stage = stage;
+		j.done = true;
+		j.start = start;
+		j.end = end;
+	}
+
+	// until every job added so far and every job those add is done
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock, [this] { return unfinished == 0; });
+	}
+
+	// one row per stage, in the order the stages started: its jobs, when the first started and the
+	// last ended, the time its jobs ran summed over threads and a bar of when it ran
+	void print_timeline()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		struct stage_row
+		{
+			std::string name;
+			size_t jobs = 0;
+			double start = 1e30, end = 0.0, busy = 0.0;
+		};
+		std::vector<stage_row> rows;
+		std::map<std::string, size_t> row_index;
+		double total = 0.0;
+		for (const job& j : jobs)
+		{
+			auto it = row_index.find(j.stage);
+			if (it == row_index.end())
+			{
+				it = row_index.insert(std::make_pair(j.stage, rows.size())).first;
+				rows.emplace_back();
+				rows.back().name = j.stage;
+			}
+
+			stage_row& row = rows[it->second];
+			double start = seconds(j.start), end = seconds(j.end);
+			row.jobs++;
+			row.start = std::min(row.start, start);
+			row.end = std::max(row.end, end);
+			row.busy += end - start;
+			total = std::max(total, end);
+		}
+
+		std::sort(rows.begin(), rows.end(), [](const stage_row& a, const stage_row& b) { return a.start < b.start; });
+
+		const int bar_width = 40;
+		INFO("startup timeline, %zu threads, %.3fs:", workers.size(), static_cast<float>(total));
+		for (const stage_row& row : rows)
+		{
+			char bar[bar_width + 1];
+			int first = total > 0 ? static_cast<int>(row.start / total * bar_width) : 0;
+			int last = total > 0 ? static_cast<int>(row.end / total * bar_width) : 0;
+			for (int c = 0; c < bar_width; c++)
+				bar[c] = c >= first && c <= std::min(last, bar_width - 1) ? '#' : '.';
+			bar[bar_width] = '\0';
+
+			printf("  %-18s %4zu job%s %8.1fms - %8.1fms, busy %8.1fms |%s|\n", row.name.c_str(), row.jobs, row.jobs == 1 ? " " : "s",
+				1000.0 * row.start, 1000.0 * row.end, 1000.0 * row.busy, bar);
+		}
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct job
+	{
+		std::string stage;
+		std::function<void()> work;
+		std::vector<job_id> dependents;
+		size_t waiting = 0;
+		bool done = false;
+		clock::time_point start, end;
+	};
+
+	// a deque keeps references to its jobs valid while more are added
+	std::deque<job> jobs;
+	std::deque<job_id> ready;
+	size_t unfinished = 0;
+	bool stopping = false;
+
+	std::mutex mutex;
+	std::condition_variable ready_cv;
+	std::condition_variable done_cv;
+	std::vector<std::thread> workers;
+	clock::time_point origin;
+
+	double seconds(clock::time_point t) const
+	{
+		return std::chrono::duration<double>(t - origin).count();
+	}
+
+	void work()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			ready_cv.wait(lock, [this] { return stopping || !ready.empty(); });
+			if (ready.empty())
+				return;
+
+			job_id id = ready.front();
+			ready.pop_front();
+			std::function<void()> work = std::move(jobs[id].work);
+			jobs[id].start = clock::now();
+
+			lock.unlock();
+			work();
+			lock.lock();
+
+			job& j = jobs[id];
+			j.end = clock::now();
+			j.done = true;
+			for (job_id d : j.dependents)
+			{
+				if (--jobs[d].waiting == 0)
+				{
+					ready.push_back(d);
+					ready_cv.notify_one();
+				}
+			}
+
+			if (--unfinished == 0)
+				done_cv.notify_all();
+		}
+	}
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// a whole file mapped read only, the pages are read in by the os when they are first touched
+class mapped_file
+{
+public:
+	static std::shared_ptr<mapped_file> open(const std::string& path)
+	{
+		std::shared_ptr<mapped_file> file(new mapped_file());
+#ifdef _WIN32
+		file->handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file->handle == INVALID_HANDLE_VALUE)
+			return nullptr;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file->handle, &size) || size.QuadPart == 0)
+			return nullptr;
+		file->mapping = CreateFileMappingA(file->handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!file->mapping)
+			return nullptr;
+		file->bytes = static_cast<const unsigned char*>(MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0));
+		file->length = static_cast<size_t>(size.QuadPart);
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return nullptr;
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0)
+		{
+			close(fd);
+			return nullptr;
+		}
+		void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (address == MAP_FAILED)
+			return nullptr;
+		file->bytes = static_cast<const unsigned char*>(address);
+		file->length = static_cast<size_t>(info.st_size);
+#endif
+		return file->bytes ? file : nullptr;
+	}
+
+	~mapped_file()
+	{
+#ifdef _WIN32
+		if (bytes)
+			UnmapViewOfFile(bytes);
+		if (mapping)
+			CloseHandle(mapping);
+		if (handle != INVALID_HANDLE_VALUE)
+			CloseHandle(handle);
+#else
+		if (bytes)
+			munmap(const_cast<unsigned char*>(bytes), length);
+#endif
+	}
+
+	const unsigned char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	mapped_file() {}
+
+	const unsigned char* bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
@@ -179,7 +179,7 @@ class diffuse_light : public material
         virtual color emitted(const hit_record& rec) const override
         {
             if (rec.front_face)
-                return emit->value(rec.uv, rec.p);
+                return emit->value(rec.uv, rec.p, rec.footprint);
             else
                 return color(0,0,0);
         }
@@ -191,7 +191,15 @@ class diffuse_light : public material
 class phong : public material
 {
 public:
-    phong(shared_ptr<texture> Kd, shared_ptr<texture> Ks, fType Ns) : diffuse(Kd), specular(Ks), shiness(Ns) 
+    phong(shared_ptr<texture> Kd, shared_ptr<texture> Ks, fType Ns, bool textures_loaded = true) : diffuse(Kd), specular(Ks), shiness(Ns) 
+    {
+        if (textures_loaded)
+            prepare();
+    }
+
+    // scales the textures down to conserve energy and weighs the lobes by their average, which needs
+    // the textures' pixels. startup calls it once the textures are loaded
+    void prepare()
     {
         if (ensureEnergyConservation)
         {
@@ -227,11 +235,11 @@ public:
             vec3 wi_r(-wi.x, wi.y, -wi.z);
             fType alpha = dot(wo, wi_r);
 			if (alpha > 0)
-				result += specular->value(rec.uv, rec.p) * (shiness + 2) * INV_TWOPI * std::pow(alpha, shiness);
+				result += specular->value(rec.uv, rec.p, rec.footprint) * (shiness + 2) * INV_TWOPI * std::pow(alpha, shiness);
 		}
 
 		if (hasDiffuse)
-			result += diffuse->value(rec.uv, rec.p) * INV_PI;
+			result += diffuse->value(rec.uv, rec.p, rec.footprint) * INV_PI;
 
 		return result * wo.y;
 	}
@@ -11,21 +11,38 @@
 #include "vector2.h"
 #include "vector3.h"
 #include "triangle.h"
-#include "hittable_list.h"
 #include "cdf.h"
 
-class mesh : public hittable_list
+class mesh : public hittable
 {
 public:
-    mesh(std::string& n, shared_ptr<material> mat) : name(n), mat_ptr(mat), hittable_list() 
+    mesh(std::string& n, shared_ptr<material> mat) : name(n), mat_ptr(mat)
     {
+        aabb_ptr = make_shared<aabb>();
         m_surfaceArea = m_invSurfaceArea = -1;
 
     }
+
+    // meshes are intersected through the scene's bvh over all triangles
+    virtual bool hit_fast(const ray& r, fType t_min, fType t_max) const override
+    {
+        return false;
+    }
+
+    virtual bool hit(const ray& r, fType t_min, fType t_max, hit_cache& cache) const override
+    {
+        return false;
+    }
+
+    void add(const triangle& tri, const aabb& bound)
+    {
+        triangles.push_back(tri);
+        aabb_ptr->extand(bound);
+    }
     
     void prepareSamplingTable()
     {
-        uint32_t triangleCount = objects.size();
+        uint32_t triangleCount = triangles.size();
         if (triangleCount == 0)
         {
             WARN("sampling a empty triangle mesh.");
@@ -37,7 +54,7 @@ public:
             /* Generate a PDF for sampling wrt. area */
             m_cdf = make_shared<cdf>(triangleCount);
 			for (size_t i = 0; i < triangleCount; i++)
-				m_cdf->append(std::dynamic_pointer_cast<triangle>(objects[i])->surfaceArea(vertices));
+				m_cdf->append(triangles[i].surfaceArea(vertices));
 
 			m_surfaceArea = m_cdf->normalize();
 			m_invSurfaceArea = 1.0 / m_surfaceArea;
@@ -47,8 +64,7 @@ public:
     color sampleDirect(const point3& ori_p, const vec3& ori_normal, hit_record& rec, vec3& light_dir, fType& sample_pdf)
     {
 		size_t index = m_cdf->sample(random_value());
-        auto tri_ptr = std::dynamic_pointer_cast<triangle>(objects[index]);
-        tri_ptr->sample(vertices, normals, texcoords, rec);
+        triangles[index].sample(vertices, normals, texcoords, rec);
 
         light_dir = rec.p - ori_p;
         rec.front_face = dot(light_dir, rec.normal) < 0;
@@ -71,7 +87,7 @@ public:
     }
 
 	// Query the probability density of samplePosition() for a particular point on the surface.
-	fType pdfPosition()
+	fType pdfPosition() const
     {
         return m_invSurfaceArea;
     }
@@ -85,6 +101,8 @@ public:
     std::string name;
     shared_ptr<material> mat_ptr;
 
+    std::vector<triangle> triangles;
+
     std::vector<point3> vertices;
 	std::vector<point3> normals;
 	std::vector<point2> texcoords;
@@ -16,6 +16,8 @@
 #include "triangle.h"
 #include "hittable_list.h"
 #include "bvh.h"
+#include "obj_loader.h"
+#include "jobs.h"
 
 #ifndef USE_FP32
 #define TINYOBJLOADER_USE_DOUBLE
@@ -25,39 +27,34 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <cstring>
+#include <tuple>
 
 class model : public hittable_list
 {
 public:
 	model() : hittable_list() {}
 
-	bool loadObj(std::string& file_path, shared_ptr<hittable_list> lights, std::map<std::string, vec3>& matname2radiance)
+	//parses the obj on the calling thread and leaves the textures and the meshes to jobs, objects
+	//holds every mesh once meshes_ready is done
+	bool loadObj(std::string& file_path, shared_ptr<hittable_list> lights, std::map<std::string, vec3>& matname2radiance, job_graph& jobs)
 	{
-		tinyobj::attrib_t inattrib;
-		std::vector<tinyobj::shape_t> inshapes;
+		// kept alive by the weld jobs
+		auto parsed = make_shared<std::pair<tinyobj::attrib_t, std::vector<tinyobj::shape_t>>>();
+		tinyobj::attrib_t& inattrib = parsed->first;
+		std::vector<tinyobj::shape_t>& inshapes = parsed->second;
 		std::vector<tinyobj::material_t> inmaterials;
 
-		size_t dot_pos = file_path.find_last_of('.');
-		if (dot_pos == std::string::npos)
-			dot_pos = file_path.length();
-
-		size_t slash_pos = file_path.find_last_of("/\\");
-		if (slash_pos != std::string::npos)
-		{
-			file_name = file_path.substr(slash_pos + 1, dot_pos - slash_pos - 1);
-			file_dir = file_path.substr(0, slash_pos);
-		}
-		else
-		{
-			file_name = file_path.substr(0, dot_pos);
-			file_dir = ".";
-		}
-
-		file_dir += "/";
+		setPath(file_path);
 
 		std::string warn;
 		std::string err;
-		bool ret = tinyobj::LoadObj(&inattrib, &inshapes, &inmaterials, &warn, &err, file_path.c_str(), file_dir.c_str(), true);
+		bool ret;
+		jobs.run("parse obj", [&]()
+			{
+				ret = parallel_parse ? load_obj_parallel(&inattrib, &inshapes, &inmaterials, &warn, &err, file_path.c_str(), file_dir.c_str())
+					: tinyobj::LoadObj(&inattrib, &inshapes, &inmaterials, &warn, &err, file_path.c_str(), file_dir.c_str(), true);
+			});
 		if (!warn.empty())
 			WARN("loading obj file %s with warn info: %s", file_path.c_str(), warn.c_str());
 		if (!err.empty())
@@ -75,20 +72,41 @@ public:
 		INFO("# of shapes    = %d", (int)inshapes.size());
 
 		std::vector<int> light_mat_index;
-		loadMaterials(inmaterials, matname2radiance, light_mat_index);
+		loadMaterials(inmaterials, matname2radiance, light_mat_index, jobs);
+		source_materials = inmaterials;
 
 		if (inattrib.normals.size() == 0)
 			WARN("need to regenerate all normals");
 
-		loadMeshes(inattrib, inshapes, light_mat_index, lights);
+		loadMeshes(parsed, light_mat_index, lights, jobs);
 
 		return true;
 	}
 
-private:
+	void setPath(const std::string& file_path)
+	{
+		size_t dot_pos = file_path.find_last_of('.');
+		if (dot_pos == std::string::npos)
+			dot_pos = file_path.length();
+
+		size_t slash_pos = file_path.find_last_of("/\\");
+		if (slash_pos != std::string::npos)
+		{
+			file_name = file_path.substr(slash_pos + 1, dot_pos - slash_pos - 1);
+			file_dir = file_path.substr(0, slash_pos);
+		}
+		else
+		{
+			file_name = file_path.substr(0, dot_pos);
+			file_dir = ".";
+		}
+
+		file_dir += "/";
+	}
 
-	//load diffuse textures and set up materials
-	bool loadMaterials(std::vector<tinyobj::material_t>& inmaterials, std::map<std::string, vec3>& matname2radiance, std::vector<int>& light_mat_index)
+	//set up materials, their textures are decoded, linearized and mipmapped by jobs and the materials prepared after them
+	bool loadMaterials(std::vector<tinyobj::material_t>& inmaterials, std::map<std::string, vec3>& matname2radiance, std::vector<int>& light_mat_index,
+		job_graph& jobs)
 	{
 		// Load diffuse textures
 		for (size_t m = 0; m < inmaterials.size(); m++)
@@ -111,6 +129,8 @@ private:
 			{
 				shared_ptr<texture> tex_diffuse;
 				shared_ptr<texture> tex_specular;
+				job_graph::job_id diffuse_ready = job_graph::none;
+				job_graph::job_id specular_ready = job_graph::none;
 
 				//diffuse
 				if (mp->diffuse_texname.length() > 0)
@@ -120,8 +140,8 @@ private:
 						continue;
 
 					std::string texture_filename = file_dir + mp->diffuse_texname;
-					auto tex = make_shared<image_texture>(texture_filename.c_str());
-					INFO("Loaded diffuse texture %s with w = %d, h = %d", texture_filename.c_str(), tex->width, tex->height);
+					auto tex = make_shared<image_texture>();
+					diffuse_ready = loadTexture(tex, texture_filename, "diffuse", jobs);
 
 					tex_diffuse = static_cast<shared_ptr<texture>>(tex);
 				}
@@ -138,8 +158,8 @@ private:
 						continue;
 
 					std::string texture_filename = file_dir + mp->specular_texname;
-					auto tex = make_shared<image_texture>(texture_filename.c_str());
-					INFO("Loaded specular texture %s with w = %d, h = %d", texture_filename.c_str(), tex->width, tex->height);
+					auto tex = make_shared<image_texture>();
+					specular_ready = loadTexture(tex, texture_filename, "specular", jobs);
 
 					tex_specular = static_cast<shared_ptr<texture>>(tex);
 				}
@@ -148,7 +168,9 @@ private:
 
 				textures.insert(std::make_pair(mp->specular_texname, tex_specular));
 
-				mat = make_shared<phong>(tex_diffuse, tex_specular, mp->shininess);
+				auto phong_mat = make_shared<phong>(tex_diffuse, tex_specular, mp->shininess, false);
+				jobs.add("prepare material", [phong_mat]() { phong_mat->prepare(); }, { diffuse_ready, specular_ready });
+				mat = phong_mat;
 			}
 			
 			materials.push_back(mat);
@@ -157,6 +179,24 @@ private:
 		return true;
 	}
 
+	//prints the textures loaded since the last call, once their jobs are done
+	void printTextures()
+	{
+		for (auto& [kind, filename, tex] : loaded_textures)
+			INFO("Loaded %s texture %s with w = %d, h = %d", kind.c_str(), filename.c_str(), tex->width, tex->height);
+		loaded_textures.clear();
+	}
+
+private:
+	//returns the job after which tex holds every level of its mip pyramid
+	job_graph::job_id loadTexture(shared_ptr<image_texture> tex, const std::string& filename, const char* kind, job_graph& jobs)
+	{
+		loaded_textures.emplace_back(kind, filename, tex);
+		job_graph::job_id decoded = jobs.add("decode texture", [tex, filename]() { tex->decode(filename.c_str()); });
+		job_graph::job_id linearized = jobs.add("linearize texture", [tex]() { tex->linearize(); }, { decoded });
+		return jobs.add("build mipmaps", [tex]() { tex->build_mipmaps(); }, { linearized });
+	}
+
 	struct Vertex 
 	{
 		point3 p;
@@ -164,138 +204,190 @@ private:
 		point2 uv;
 	};
 
-	/// For using vertices as keys in an associative structure
-	struct vertex_key_order : public std::binary_function<Vertex, Vertex, bool> 
+	/// Open addressing table of the vertices welded so far, a slot holds the vertex's index in the
+	/// buffer plus one, 0 marks an empty slot. Vertices are equal when all of their components compare
+	/// equal, so 0 and -0 weld as they did with an ordered map
+	struct vertex_table
 	{
-	public:
-		bool operator()(const Vertex& v1, const Vertex& v2) const 
+		std::vector<uint32_t> slots;
+		size_t mask;
+
+		vertex_table(size_t max_vertices)
 		{
-			if (v1.p.x < v2.p.x) return true;
-			else if (v1.p.x > v2.p.x) return false;
-			if (v1.p.y < v2.p.y) return true;
-			else if (v1.p.y > v2.p.y) return false;
-			if (v1.p.z < v2.p.z) return true;
-			else if (v1.p.z > v2.p.z) return false;
-			if (v1.n.x < v2.n.x) return true;
-			else if (v1.n.x > v2.n.x) return false;
-			if (v1.n.y < v2.n.y) return true;
-			else if (v1.n.y > v2.n.y) return false;
-			if (v1.n.z < v2.n.z) return true;
-			else if (v1.n.z > v2.n.z) return false;
-			if (v1.uv.x < v2.uv.x) return true;
-			else if (v1.uv.x > v2.uv.x) return false;
-			if (v1.uv.y < v2.uv.y) return true;
-			else if (v1.uv.y > v2.uv.y) return false;
-			return false;
+			size_t size = 16;
+			while (size < 2 * max_vertices)
+				size <<= 1;
+			slots.assign(size, 0);
+			mask = size - 1;
 		}
-	};
 
-	//set up meshes and get bounding box's size
-	bool loadMeshes(tinyobj::attrib_t& attrib, std::vector<tinyobj::shape_t>& shapes, std::vector<int>& light_mat_index, shared_ptr<hittable_list> lights)
-	{
-		typedef std::map<Vertex, uint32_t, vertex_key_order> VertexMapType;
-		VertexMapType vertexMap;
-		std::vector<Vertex> vertexBuffer;
+		static inline uint64_t bits(fType x)
+		{
+			x += fType(0);
+			uint64_t b = 0;
+			memcpy(&b, &x, sizeof(x));
+			return b;
+		}
 
-		// Collapse the mesh into a more usable form
-		for (size_t s = 0; s < shapes.size(); s++) 
+		static inline uint64_t hash(const Vertex& v)
 		{
-			tinyobj::shape_t& inshape = shapes[s];
-			tinyobj::mesh_t& inmesh = inshape.mesh;
-			
-			int triangle_count = inmesh.indices.size() / 3;
-			if (triangle_count == 0)
-				continue;
+			uint64_t h = mix_bits(bits(v.p.x) ^ (bits(v.p.y) << 32) ^ bits(v.p.z) * 0x9E3779B97F4A7C15ull);
+			h = mix_bits(h ^ bits(v.n.x) ^ (bits(v.n.y) << 32) ^ bits(v.n.z) * 0xBF58476D1CE4E5B9ull);
+			return mix_bits(h ^ bits(v.uv.x) ^ (bits(v.uv.y) << 32));
+		}
 
-			int mesh_count = 0;
-			vertexMap.clear();
-			vertexBuffer.clear();
+		static inline bool equal(const Vertex& v1, const Vertex& v2)
+		{
+			return v1.p.x == v2.p.x && v1.p.y == v2.p.y && v1.p.z == v2.p.z
+				&& v1.n.x == v2.n.x && v1.n.y == v2.n.y && v1.n.z == v2.n.z
+				&& v1.uv.x == v2.uv.x && v1.uv.y == v2.uv.y;
+		}
 
-			shared_ptr<mesh> mesh_ptr = nullptr;
-			for (size_t f = 0; f < triangle_count; f++)
+		// index of the vertex in buffer, appended to it when no equal vertex is there yet
+		uint32_t insert(const Vertex& vertex, std::vector<Vertex>& buffer)
+		{
+			for (size_t slot = hash(vertex) & mask;; slot = (slot + 1) & mask)
 			{
-				int current_material_id = inmesh.material_ids[f];
-				if(!mesh_ptr)
-					mesh_ptr = make_shared<mesh>(inshape.name + std::to_string(mesh_count++), materials[current_material_id]);
+				uint32_t entry = slots[slot];
+				if (entry == 0)
+				{
+					buffer.push_back(vertex);
+					slots[slot] = (uint32_t)buffer.size();
+					return slots[slot] - 1;
+				}
+				if (equal(buffer[entry - 1], vertex))
+					return entry - 1;
+			}
+		}
+	};
+
+	//set up meshes and get bounding box's size. shapes are welded independently, so each is collapsed
+	//by its own job and a last job adds their meshes in order
+	void loadMeshes(shared_ptr<std::pair<tinyobj::attrib_t, std::vector<tinyobj::shape_t>>> parsed, const std::vector<int>& light_mat_index,
+		shared_ptr<hittable_list> lights, job_graph& jobs)
+	{
+		size_t shape_count = parsed->second.size();
+		auto shape_meshes = make_shared<std::vector<std::vector<std::pair<shared_ptr<mesh>, int>>>>(shape_count);
 
-				shared_ptr<triangle> tri = make_shared<triangle>();
-				auto tri_aabb = tri->bounding_box();
+		std::vector<job_graph::job_id> welds(shape_count);
+		for (size_t s = 0; s < shape_count; s++)
+		{
+			welds[s] = jobs.add("weld shapes", [this, parsed, shape_meshes, s]()
+				{
+					collapseShape(parsed->first, parsed->second[s], (*shape_meshes)[s]);
+				});
+		}
 
-				for (size_t i = 0; i < 3; i++)
+		meshes_ready = jobs.add("collect meshes", [this, shape_meshes, light_mat_index, lights]()
+			{
+				for (auto& meshes : *shape_meshes)
 				{
-					tinyobj::index_t idx = inmesh.indices[3 * f + i];
+					for (auto& [mesh_ptr, material_id] : meshes)
+					{
+						this->add(mesh_ptr);
+
+						for (size_t i = 0; i < light_mat_index.size(); i++)
+							if (light_mat_index[i] == material_id)
+							{
+								mesh_ptr->is_light = true;
+								lights->add(mesh_ptr);
+								break;
+							}
+					}
+				}
+			}, welds);
+	}
 
-					int vertexId = idx.vertex_index;
-					int normalId = idx.normal_index;
-					int uvId = idx.texcoord_index;
-					uint32_t key;
+	// Collapse a shape into a more usable form, one mesh per run of faces with the same material
+	void collapseShape(tinyobj::attrib_t& attrib, const tinyobj::shape_t& inshape, std::vector<std::pair<shared_ptr<mesh>, int>>& meshes)
+	{
+		const tinyobj::mesh_t& inmesh = inshape.mesh;
 
-					Vertex vertex;
-					vertex.p.assign(&attrib.vertices[3 * vertexId]);
-					tri_aabb->extand(vertex.p);
+		size_t triangle_count = inmesh.indices.size() / 3;
+		if (triangle_count == 0)
+			return;
 
-					if (attrib.normals.size() > 0)
-						vertex.n.assign(&attrib.normals[3 * normalId]);
+		int mesh_count = 0;
+		vertex_table vertexTable(inmesh.indices.size());
+		std::vector<Vertex> vertexBuffer;
 
-					if (attrib.texcoords.size() > 0)
-						vertex.uv.assign(&attrib.texcoords[2 * uvId]);
+		shared_ptr<mesh> mesh_ptr = nullptr;
+		for (size_t f = 0; f < triangle_count; f++)
+		{
+			int current_material_id = inmesh.material_ids[f];
+			if (!mesh_ptr)
+			{
+				std::string mesh_name = inshape.name + std::to_string(mesh_count++);
+				mesh_ptr = make_shared<mesh>(mesh_name, materials[current_material_id]);
+			}
 
-					VertexMapType::iterator it = vertexMap.find(vertex);
-					if (it != vertexMap.end()) 
-						key = it->second;
-					else 
-					{
-						key = (uint32_t)vertexBuffer.size();
-						vertexMap[vertex] = key;
-						vertexBuffer.push_back(vertex);
-					}
+			triangle tri;
+			aabb tri_aabb;
 
-					tri->idx[i] = key;
-				}
+			for (size_t i = 0; i < 3; i++)
+			{
+				tinyobj::index_t idx = inmesh.indices[3 * f + i];
 
-				mesh_ptr->add(tri);
+				int vertexId = idx.vertex_index;
+				int normalId = idx.normal_index;
+				int uvId = idx.texcoord_index;
 
-				int next_material_id = f + 1 < triangle_count ? inmesh.material_ids[f + 1] : -1;
-				if (current_material_id != next_material_id)
-				{
-					//commit mesh
-					int vertex_count = vertexBuffer.size();
+				Vertex vertex;
+				vertex.p.assign(&attrib.vertices[3 * vertexId]);
+				tri_aabb.extand(vertex.p);
 
-					mesh_ptr->vertices.reserve(vertex_count);
-					mesh_ptr->normals.reserve(vertex_count);
-					mesh_ptr->texcoords.reserve(vertex_count);
+				if (attrib.normals.size() > 0)
+					vertex.n.assign(&attrib.normals[3 * normalId]);
 
-					for (size_t i = 0; i < vertex_count; i++)
-					{
-						mesh_ptr->vertices.push_back(vertexBuffer[i].p);
-						mesh_ptr->normals.push_back(vertexBuffer[i].n);
-						mesh_ptr->texcoords.push_back(vertexBuffer[i].uv);
-					}
+				if (attrib.texcoords.size() > 0)
+					vertex.uv.assign(&attrib.texcoords[2 * uvId]);
 
-					this->add(mesh_ptr);
+				tri.idx[i] = vertexTable.insert(vertex, vertexBuffer);
+			}
+
+			mesh_ptr->add(tri, tri_aabb);
+
+			int next_material_id = f + 1 < triangle_count ? inmesh.material_ids[f + 1] : -1;
+			if (current_material_id != next_material_id)
+			{
+				//commit mesh
+				size_t vertex_count = vertexBuffer.size();
 
-					for (size_t i = 0; i < light_mat_index.size(); i++)
-						if (light_mat_index[i] == current_material_id)
-						{
-							mesh_ptr->is_light = true;
-							lights->add(mesh_ptr);
-							break;
-						}
+				mesh_ptr->vertices.reserve(vertex_count);
+				mesh_ptr->normals.reserve(vertex_count);
+				mesh_ptr->texcoords.reserve(vertex_count);
 
-					mesh_ptr = nullptr;
+				for (size_t i = 0; i < vertex_count; i++)
+				{
+					mesh_ptr->vertices.push_back(vertexBuffer[i].p);
+					mesh_ptr->normals.push_back(vertexBuffer[i].n);
+					mesh_ptr->texcoords.push_back(vertexBuffer[i].uv);
 				}
+
+				meshes.emplace_back(mesh_ptr, current_material_id);
+				mesh_ptr = nullptr;
 			}
 		}
-
-		return true;
 	}
 
 public:
 	std::string file_name;
 	std::string file_dir;
 
+	// parse the obj with all threads, see load_obj_parallel
+	bool parallel_parse = true;
+
+	// job of loadObj after which objects holds every mesh
+	job_graph::job_id meshes_ready = job_graph::none;
+
 	std::vector<shared_ptr<material>> materials;
 	std::map<std::string, shared_ptr<texture>> textures;
+
+	// kind and file of every texture loadMaterials started, for printTextures
+	std::vector<std::tuple<std::string, std::string, shared_ptr<image_texture>>> loaded_textures;
+
+	// materials of the obj as parsed, kept for the scene cache
+	std::vector<tinyobj::material_t> source_materials;
 };
 
 #endif /* model_h */
\ No newline at end of file
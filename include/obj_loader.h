@@ -0,0 +1,654 @@
+#pragma once
+
+#include "common.h"
+#include "mapped_file.h"
+#include "tiny_obj_loader.h"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <algorithm>
+#include <omp.h>
+
+// parallel path of model::loadObj. the obj is mapped and cut into runs of whole lines that threads
+// parse at the same time into their own vertex, normal, texcoord and face arrays. the arrays are
+// then joined and the few other lines (usemtl, mtllib, g, o, s) are replayed in file order to cut
+// the faces into shapes, giving what tinyobj::LoadObj gives with triangulation on.
+// what this path does not reproduce exactly, lines, points, tags, skin weights, faces of other
+// than 3 or 4 corners and faces with indices tinyobj warns about, is left to tinyobj::LoadObj.
+// vertex colors are not read
+
+// tinyobj's tryParseDouble, so both paths read the same floats. it does not look at s_end
+inline bool obj_parse_double(const char* s, const char* s_end, double* result)
+{
+	if (s >= s_end)
+		return false;
+
+	double mantissa = 0.0;
+	int exponent = 0;
+	char sign = '+';
+	char exp_sign = '+';
+	const char* curr = s;
+	int read = 0;
+	bool end_not_reached = false;
+	bool leading_decimal_dots = false;
+
+	if (*curr == '+' || *curr == '-')
+	{
+		sign = *curr;
+		curr++;
+		if ((curr != s_end) && (*curr == '.'))
+			leading_decimal_dots = true;
+	}
+	else if (*curr >= '0' && *curr <= '9') {}
+	else if (*curr == '.')
+		leading_decimal_dots = true;
+	else
+		return false;
+
+	end_not_reached = (curr != s_end);
+	if (!leading_decimal_dots)
+	{
+		while (end_not_reached && *curr >= '0' && *curr <= '9')
+		{
+			mantissa *= 10;
+			mantissa += static_cast<int>(*curr - 0x30);
+			curr++;
+			read++;
+			end_not_reached = (curr != s_end);
+		}
+
+		if (read == 0)
+			return false;
+	}
+
+	if (end_not_reached)
+	{
+		if (*curr == '.')
+		{
+			curr++;
+			read = 1;
+			end_not_reached = (curr != s_end);
+			while (end_not_reached && *curr >= '0' && *curr <= '9')
+			{
+				static const double pow_lut[] = { 1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001 };
+				const int lut_entries = sizeof pow_lut / sizeof pow_lut[0];
+
+				mantissa += static_cast<int>(*curr - 0x30) * (read < lut_entries ? pow_lut[read] : std::pow(10.0, -read));
+				read++;
+				curr++;
+				end_not_reached = (curr != s_end);
+			}
+		}
+
+		if (end_not_reached && (*curr == 'e' || *curr == 'E'))
+		{
+			curr++;
+			end_not_reached = (curr != s_end);
+			if (end_not_reached && (*curr == '+' || *curr == '-'))
+			{
+				exp_sign = *curr;
+				curr++;
+			}
+			else if (!end_not_reached || *curr < '0' || *curr > '9')
+				return false;
+
+			read = 0;
+			end_not_reached = (curr != s_end);
+			while (end_not_reached && *curr >= '0' && *curr <= '9')
+			{
+				if (exponent > INT_MAX / 10)
+					return false;
+				exponent *= 10;
+				exponent += static_cast<int>(*curr - 0x30);
+				curr++;
+				read++;
+				end_not_reached = (curr != s_end);
+			}
+			exponent *= (exp_sign == '+' ? 1 : -1);
+			if (read == 0)
+				return false;
+		}
+	}
+
+	*result = (sign == '+' ? 1 : -1) * (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent) : mantissa);
+	return true;
+}
+
+inline void obj_skip_space(const char*& token, const char* end)
+{
+	while (token < end && (*token == ' ' || *token == '\t'))
+		token++;
+}
+
+inline const char* obj_word_end(const char* token, const char* end)
+{
+	while (token < end && *token != ' ' && *token != '\t')
+		token++;
+	return token;
+}
+
+inline tinyobj::real_t obj_parse_real(const char*& token, const char* end)
+{
+	obj_skip_space(token, end);
+	const char* word_end = obj_word_end(token, end);
+	double value = 0.0;
+	obj_parse_double(token, word_end, &value);
+	token = word_end;
+	return static_cast<tinyobj::real_t>(value);
+}
+
+// atoi within [token, end)
+inline int obj_parse_int(const char* token, const char* end)
+{
+	while (token < end && (*token == ' ' || (*token >= '\t' && *token <= '\r')))
+		token++;
+	bool negative = false;
+	if (token < end && (*token == '+' || *token == '-'))
+		negative = *token++ == '-';
+	int value = 0;
+	while (token < end && *token >= '0' && *token <= '9')
+		value = value * 10 + (*token++ - '0');
+	return negative ? -value : value;
+}
+
+// the lines of one run
+struct obj_chunk
+{
+	const char* begin;
+	const char* end;
+
+	std::vector<tinyobj::real_t> vertices;
+	std::vector<tinyobj::real_t> normals;
+	std::vector<tinyobj::real_t> texcoords;
+
+	// corners of all faces in order, face_sizes tells where each face ends
+	std::vector<tinyobj::index_t> corners;
+	std::vector<unsigned char> face_sizes;
+
+	// corners whose vertex, normal or texcoord index is negative and so counts back from the end of
+	// what the chunk read, they are moved by the elements of earlier chunks once those are counted
+	std::vector<size_t> relative_corners[3];
+
+	// largest index a face uses and how far a quad reaches past the vertices read before it. the
+	// quad split looks at vertex positions, which tinyobj only knows up to the current line
+	int max_index[3] = { -1, -1, -1 };
+	int64_t quad_reach = INT64_MIN;
+
+	// lines that are neither elements nor faces, with the number of faces read before them
+	struct statement
+	{
+		size_t face;
+		const char* begin;
+		const char* end;
+	};
+	std::vector<statement> statements;
+
+	bool supported = true;
+};
+
+// one corner of a face: v, v/vt, v//vn or v/vt/vn
+inline bool obj_parse_corner(const char*& token, const char* end, obj_chunk& chunk, tinyobj::index_t& index, bool relative[3])
+{
+	const size_t counts[3] = { chunk.vertices.size() / 3, chunk.normals.size() / 3, chunk.texcoords.size() / 2 };
+	int* fields[3] = { &index.vertex_index, &index.normal_index, &index.texcoord_index };
+	auto parse_field = [&](int f)
+		{
+			int raw = obj_parse_int(token, end);
+			if (raw == 0)
+				return false;
+			relative[f] = raw < 0;
+			*fields[f] = raw > 0 ? raw - 1 : static_cast<int>(counts[f]) + raw;
+			while (token < end && *token != '/' && *token != ' ' && *token != '\t')
+				token++;
+			return true;
+		};
+
+	index.vertex_index = index.normal_index = index.texcoord_index = -1;
+	relative[0] = relative[1] = relative[2] = false;
+
+	if (!parse_field(0))
+		return false;
+	if (token >= end || *token != '/')
+		return true;
+	token++;
+
+	if (token < end && *token == '/')
+	{
+		token++;
+		return parse_field(1);
+	}
+
+	if (!parse_field(2))
+		return false;
+	if (token >= end || *token != '/')
+		return true;
+	token++;
+	return parse_field(1);
+}
+
+inline void obj_parse_face(const char* token, const char* end, obj_chunk& chunk)
+{
+	obj_skip_space(token, end);
+
+	size_t first = chunk.corners.size();
+	while (token < end)
+	{
+		tinyobj::index_t index;
+		bool relative[3];
+		if (!obj_parse_corner(token, end, chunk, index, relative))
+		{
+			chunk.supported = false;
+			return;
+		}
+
+		int fields[3] = { index.vertex_index, index.normal_index, index.texcoord_index };
+		for (int f = 0; f < 3; f++)
+		{
+			if (relative[f])
+				chunk.relative_corners[f].push_back(chunk.corners.size());
+			else
+				chunk.max_index[f] = std::max(chunk.max_index[f], fields[f]);
+		}
+
+		chunk.corners.push_back(index);
+		while (token < end && (*token == ' ' || *token == '\t'))
+			token++;
+	}
+
+	size_t count = chunk.corners.size() - first;
+	if (count != 3 && count != 4)
+	{
+		chunk.supported = false;
+		return;
+	}
+
+	if (count == 4)
+	{
+		int64_t read = chunk.vertices.size() / 3;
+		for (size_t c = first; c < first + 4; c++)
+			chunk.quad_reach = std::max(chunk.quad_reach, chunk.corners[c].vertex_index - read);
+	}
+
+	chunk.face_sizes.push_back(static_cast<unsigned char>(count));
+}
+
+inline void obj_parse_chunk(obj_chunk& chunk)
+{
+	const char* line = chunk.begin;
+	while (line < chunk.end && chunk.supported)
+	{
+		// lines end at \n, \r\n or \r like in tinyobj
+		const char* line_end = line;
+		while (line_end < chunk.end && *line_end != '\n' && *line_end != '\r')
+			line_end++;
+		const char* next = line_end;
+		if (next < chunk.end && *next++ == '\r' && next < chunk.end && *next == '\n')
+			next++;
+
+		const char* token = line;
+		obj_skip_space(token, line_end);
+		size_t length = line_end - token;
+		char c0 = length > 0 ? token[0] : '\0';
+		char c1 = length > 1 ? token[1] : '\0';
+		char c2 = length > 2 ? token[2] : '\0';
+		auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+
+		if (c0 == '\0' || c0 == '#') {}
+		else if (c0 == 'v' && is_space(c1))
+		{
+			token += 2;
+			for (int i = 0; i < 3; i++)
+				chunk.vertices.push_back(obj_parse_real(token, line_end));
+		}
+		else if (c0 == 'v' && c1 == 'n' && is_space(c2))
+		{
+			token += 3;
+			for (int i = 0; i < 3; i++)
+				chunk.normals.push_back(obj_parse_real(token, line_end));
+		}
+		else if (c0 == 'v' && c1 == 't' && is_space(c2))
+		{
+			token += 3;
+			for (int i = 0; i < 2; i++)
+				chunk.texcoords.push_back(obj_parse_real(token, line_end));
+		}
+		else if ((c0 == 'v' && c1 == 'w' && is_space(c2)) || ((c0 == 'l' || c0 == 'p' || c0 == 't') && is_space(c1)))
+			chunk.supported = false;
+		else if (c0 == 'f' && is_space(c1))
+			obj_parse_face(token + 2, line_end, chunk);
+		else if ((length >= 6 && !strncmp(token, "usemtl", 6)) || (length > 6 && !strncmp(token, "mtllib", 6) && is_space(token[6]))
+			|| ((c0 == 'g' || c0 == 'o' || c0 == 's') && is_space(c1)))
+			chunk.statements.push_back({ chunk.face_sizes.size(), token, line_end });
+
+		line = next;
+	}
+}
+
+// tinyobj's SplitString
+inline void obj_split_names(const std::string& s, std::vector<std::string>& names)
+{
+	std::string name;
+	bool escaping = false;
+	for (char ch : s)
+	{
+		if (escaping)
+			escaping = false;
+		else if (ch == '\\')
+		{
+			escaping = true;
+			continue;
+		}
+		else if (ch == ' ')
+		{
+			if (!name.empty())
+				names.push_back(name);
+			name.clear();
+			continue;
+		}
+		name += ch;
+	}
+	names.push_back(name);
+}
+
+// state of the replay, as kept by tinyobj::LoadObj
+struct obj_replay
+{
+	std::vector<tinyobj::shape_t>* shapes;
+	std::vector<tinyobj::material_t>* materials;
+	std::string* warn;
+	std::string* err;
+	tinyobj::MaterialFileReader reader;
+
+	std::set<std::string> material_filenames;
+	std::map<std::string, int> material_map;
+	int material = -1;
+	unsigned int smoothing_id = 0;
+	std::string name;
+	tinyobj::shape_t shape;
+
+	obj_replay(const std::string& base_dir) : reader(base_dir) {}
+
+	// false for a line tinyobj would warn about with its line number
+	bool statement(const char* token, const char* end)
+	{
+		if (!strncmp(token, "usemtl", 6))
+		{
+			token += 6;
+			obj_skip_space(token, end);
+			std::string material_name(token, obj_word_end(token, end));
+
+			int new_material = -1;
+			auto it = material_map.find(material_name);
+			if (it != material_map.end())
+				new_material = it->second;
+			else
+				(*warn) += "material [ '" + material_name + "' ] not found in .mtl\n";
+
+			material = new_material;
+		}
+		else if (!strncmp(token, "mtllib", 6))
+		{
+			std::vector<std::string> filenames;
+			obj_split_names(std::string(token + 7, end), filenames);
+
+			bool found = false;
+			for (const std::string& filename : filenames)
+			{
+				if (material_filenames.count(filename) > 0)
+				{
+					found = true;
+					continue;
+				}
+
+				std::string warn_mtl, err_mtl;
+				bool ok = reader(filename, materials, &material_map, &warn_mtl, &err_mtl);
+				(*warn) += warn_mtl;
+				(*err) += err_mtl;
+				if (ok)
+				{
+					found = true;
+					material_filenames.insert(filename);
+					break;
+				}
+			}
+
+			if (!found)
+				(*warn) += "Failed to load material file(s). Use default material.\n";
+		}
+		else if (token[0] == 'g' || token[0] == 'o')
+		{
+			if (shape.mesh.indices.size() > 0)
+				shapes->push_back(shape);
+			shape = tinyobj::shape_t();
+
+			if (token[0] == 'o')
+			{
+				name = std::string(token + 2, end);
+				return true;
+			}
+
+			// several group names are joined with spaces
+			std::vector<std::string> names;
+			while (token < end)
+			{
+				obj_skip_space(token, end);
+				const char* name_end = obj_word_end(token, end);
+				names.push_back(std::string(token, name_end));
+				token = name_end;
+				obj_skip_space(token, end);
+			}
+
+			if (names.size() < 2)
+				return false;
+			name = names[1];
+			for (size_t i = 2; i < names.size(); i++)
+				name += " " + names[i];
+		}
+		else
+		{
+			token += 2;
+			obj_skip_space(token, end);
+			if (token == end)
+				return true;
+
+			if (end - token >= 3 && !strncmp(token, "off", 3))
+				smoothing_id = 0;
+			else
+			{
+				int id = obj_parse_int(token, end);
+				smoothing_id = id < 0 ? 0 : static_cast<unsigned int>(id);
+			}
+		}
+
+		return true;
+	}
+
+	void triangle(const tinyobj::index_t& i0, const tinyobj::index_t& i1, const tinyobj::index_t& i2)
+	{
+		shape.mesh.indices.push_back(i0);
+		shape.mesh.indices.push_back(i1);
+		shape.mesh.indices.push_back(i2);
+		shape.mesh.num_face_vertices.push_back(3);
+		shape.mesh.material_ids.push_back(material);
+		shape.mesh.smoothing_group_ids.push_back(smoothing_id);
+	}
+
+	// quads are split along their shorter diagonal, the way tinyobj does
+	void face(const tinyobj::index_t* corners, int count, const std::vector<tinyobj::real_t>& v)
+	{
+		shape.name = name;
+		if (count == 3)
+		{
+			triangle(corners[0], corners[1], corners[2]);
+			return;
+		}
+
+		const tinyobj::real_t* v0 = &v[3 * corners[0].vertex_index];
+		const tinyobj::real_t* v1 = &v[3 * corners[1].vertex_index];
+		const tinyobj::real_t* v2 = &v[3 * corners[2].vertex_index];
+		const tinyobj::real_t* v3 = &v[3 * corners[3].vertex_index];
+
+		tinyobj::real_t e02x = v2[0] - v0[0];
+		tinyobj::real_t e02y = v2[1] - v0[1];
+		tinyobj::real_t e02z = v2[2] - v0[2];
+		tinyobj::real_t e13x = v3[0] - v1[0];
+		tinyobj::real_t e13y = v3[1] - v1[1];
+		tinyobj::real_t e13z = v3[2] - v1[2];
+
+		tinyobj::real_t sqr02 = e02x * e02x + e02y * e02y + e02z * e02z;
+		tinyobj::real_t sqr13 = e13x * e13x + e13y * e13y + e13z * e13z;
+
+		if (sqr02 < sqr13)
+		{
+			triangle(corners[0], corners[1], corners[2]);
+			triangle(corners[0], corners[2], corners[3]);
+		}
+		else
+		{
+			triangle(corners[0], corners[1], corners[3]);
+			triangle(corners[1], corners[2], corners[3]);
+		}
+	}
+};
+
+// drop-in for tinyobj::LoadObj with triangulation on
+inline bool load_obj_parallel(tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes, std::vector<tinyobj::material_t>* materials,
+	std::string* warn, std::string* err, const char* filename, const char* mtl_basedir)
+{
+	auto serial = [&]()
+		{
+			return tinyobj::LoadObj(attrib, shapes, materials, warn, err, filename, mtl_basedir, true);
+		};
+
+	std::shared_ptr<mapped_file> file = mapped_file::open(filename);
+	if (!file)
+		return serial();
+
+	// runs of at least a few MB, cut after a line break
+	const char* data = reinterpret_cast<const char*>(file->data());
+	const char* data_end = data + file->size();
+	const size_t min_chunk = size_t(4) << 20;
+	size_t chunk_count = std::max<size_t>(1, std::min<size_t>(8 * omp_get_max_threads(), file->size() / min_chunk));
+
+	std::vector<obj_chunk> chunks;
+	const char* begin = data;
+	for (size_t c = 1; c <= chunk_count && begin < data_end; c++)
+	{
+		const char* end = c == chunk_count ? data_end : std::max(begin, data + file->size() / chunk_count * c);
+		while (end < data_end && end[-1] != '\n')
+			end++;
+
+		chunks.emplace_back();
+		chunks.back().begin = begin;
+		chunks.back().end = end;
+		begin = end;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < (int)chunks.size(); c++)
+		obj_parse_chunk(chunks[c]);
+
+	// every chunk's elements follow those of the chunks before it
+	size_t totals[3] = { 0, 0, 0 };
+	std::vector<size_t> offsets(3 * chunks.size());
+	for (size_t c = 0; c < chunks.size(); c++)
+	{
+		obj_chunk& chunk = chunks[c];
+		const size_t counts[3] = { chunk.vertices.size() / 3, chunk.normals.size() / 3, chunk.texcoords.size() / 2 };
+		if (!chunk.supported || chunk.quad_reach >= (int64_t)totals[0])
+			return serial();
+
+		for (int f = 0; f < 3; f++)
+		{
+			offsets[3 * c + f] = totals[f];
+			for (size_t corner : chunk.relative_corners[f])
+			{
+				int* field = f == 0 ? &chunk.corners[corner].vertex_index : f == 1 ? &chunk.corners[corner].normal_index : &chunk.corners[corner].texcoord_index;
+				*field += static_cast<int>(totals[f]);
+				if (*field < 0)
+					return serial();
+			}
+			totals[f] += counts[f];
+		}
+	}
+
+	for (const obj_chunk& chunk : chunks)
+	{
+		for (int f = 0; f < 3; f++)
+		{
+			if (chunk.max_index[f] >= (int)totals[f])
+				return serial();
+		}
+	}
+
+	attrib->vertices.resize(3 * totals[0]);
+	attrib->normals.resize(3 * totals[1]);
+	attrib->texcoords.resize(2 * totals[2]);
+	attrib->colors.clear();
+	attrib->vertex_weights.clear();
+	attrib->texcoord_ws.clear();
+	attrib->skin_weights.clear();
+	shapes->clear();
+
+#pragma omp parallel for
+	for (int c = 0; c < (int)chunks.size(); c++)
+	{
+		const obj_chunk& chunk = chunks[c];
+		std::copy(chunk.vertices.begin(), chunk.vertices.end(), attrib->vertices.begin() + 3 * offsets[3 * c + 0]);
+		std::copy(chunk.normals.begin(), chunk.normals.end(), attrib->normals.begin() + 3 * offsets[3 * c + 1]);
+		std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), attrib->texcoords.begin() + 2 * offsets[3 * c + 2]);
+	}
+
+	std::string base_dir = mtl_basedir ? mtl_basedir : "";
+#ifndef _WIN32
+	const char dirsep = '/';
+#else
+	const char dirsep = '\\';
+#endif
+	if (!base_dir.empty() && base_dir.back() != dirsep)
+		base_dir += dirsep;
+
+	std::string replay_warn, replay_err;
+	std::vector<tinyobj::material_t> replay_materials;
+	obj_replay replay(base_dir);
+	replay.shapes = shapes;
+	replay.materials = &replay_materials;
+	replay.warn = &replay_warn;
+	replay.err = &replay_err;
+
+	for (const obj_chunk& chunk : chunks)
+	{
+		size_t face = 0;
+		size_t corner = 0;
+		for (size_t s = 0; s <= chunk.statements.size(); s++)
+		{
+			size_t face_end = s < chunk.statements.size() ? chunk.statements[s].face : chunk.face_sizes.size();
+			for (; face < face_end; face++)
+			{
+				replay.face(&chunk.corners[corner], chunk.face_sizes[face], attrib->vertices);
+				corner += chunk.face_sizes[face];
+			}
+
+			if (s < chunk.statements.size() && !replay.statement(chunk.statements[s].begin, chunk.statements[s].end))
+			{
+				shapes->clear();
+				return serial();
+			}
+		}
+	}
+
+	if (replay.shape.mesh.indices.size() > 0)
+		shapes->push_back(replay.shape);
+
+	materials->insert(materials->end(), replay_materials.begin(), replay_materials.end());
+	if (warn)
+		(*warn) += replay_warn;
+	if (err)
+		(*err) += replay_err;
+	return true;
+}
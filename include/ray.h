@@ -14,16 +14,46 @@ class ray
 {
 public:
     ray() {}
-    ray(const point3& ori, const vec3& dir):origin(ori), direction(dir) {}
+    ray(const point3& ori, const vec3& dir):origin(ori), direction(dir) 
+    {
+        // reciprocals and signs used by every slab test along the ray
+        for (int i = 0; i < 3; i++)
+        {
+            inv_direction[i] = 1.0 / direction[i];
+            sign[i] = inv_direction[i] < 0 ? 1 : 0;
+        }
+    }
     
     point3 at(fType t) const
     {
         return origin + t * direction;
     }
+
+    // width of the ray's cone at distance t
+    fType cone_width_at(fType t) const
+    {
+        return cone_width + cone_spread * t;
+    }
+
+    // a scattered ray goes on with the cone of parent from where parent hit at distance t
+    void continue_cone(const ray& parent, fType t)
+    {
+        cone_width = parent.cone_width_at(t);
+        cone_spread = parent.cone_spread;
+    }
     
 public:
     point3 origin;
     vec3 direction;
+
+    // the ray differentials of a camera ray kept as a cone: its width at the origin and how much
+    // wider it gets per unit of distance. textures pick their mip level from it, 0 looks up the
+    // full resolution
+    fType cone_width = 0.0;
+    fType cone_spread = 0.0;
+
+    vec3 inv_direction;
+    int sign[3];
 };
 
 #endif /* ray_h */
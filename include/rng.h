@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+// finalizer of splitmix64, spreads every input bit over the whole word
+inline uint64_t mix_bits(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+inline uint64_t splitmix64(uint64_t& state)
+{
+	return mix_bits(state += 0x9E3779B97F4A7C15ull);
+}
+
+// xoshiro128+ by Blackman and Vigna: 128 bits of state and a few adds, xors and shifts per draw.
+// its lowest bits are weak, floats are made from the top 24 bits only
+class xoshiro128p
+{
+public:
+	xoshiro128p(uint64_t seed_value = 0)
+	{
+		seed(seed_value);
+	}
+
+	void seed(uint64_t seed_value)
+	{
+		uint64_t state = seed_value;
+		uint64_t a = splitmix64(state);
+		uint64_t b = splitmix64(state);
+		s[0] = static_cast<uint32_t>(a);
+		s[1] = static_cast<uint32_t>(a >> 32);
+		s[2] = static_cast<uint32_t>(b);
+		s[3] = static_cast<uint32_t>(b >> 32);
+
+		// the all zero state never leaves zero
+		if ((s[0] | s[1] | s[2] | s[3]) == 0)
+			s[0] = 1;
+	}
+
+	inline uint32_t next()
+	{
+		const uint32_t result = s[0] + s[3];
+		const uint32_t t = s[1] << 9;
+
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = (s[3] << 11) | (s[3] >> 21);
+
+		return result;
+	}
+
+	// [0, 1)
+	inline float next_float()
+	{
+		return (next() >> 8) * 0x1.0p-24f;
+	}
+
+	// [0, 1) with 53 random bits
+	inline double next_double()
+	{
+		uint64_t hi = next() >> 6;
+		uint64_t lo = next() >> 5;
+		return ((hi << 27) | lo) * 0x1.0p-53;
+	}
+
+private:
+	uint32_t s[4];
+};
+
+// eight xoshiro128+ streams side by side, for code that needs many numbers at once.
+// one step of all eight lanes is a handful of simd instructions
+class xoshiro128p_x8
+{
+public:
+	xoshiro128p_x8(uint64_t seed_value = 0)
+	{
+		seed(seed_value);
+	}
+
+	void seed(uint64_t seed_value)
+	{
+		uint64_t state = seed_value;
+		for (int lane = 0; lane < 8; lane++)
+		{
+			xoshiro128p lane_rng(splitmix64(state));
+			for (int w = 0; w < 4; w++)
+				s[w][lane] = lane_rng.next();
+			if ((s[0][lane] | s[1][lane] | s[2][lane] | s[3][lane]) == 0)
+				s[0][lane] = 1;
+		}
+	}
+
+	// count floats in [0, 1)
+	void fill(float* out, size_t count)
+	{
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8)
+			next8(out + i);
+
+		if (i < count)
+		{
+			alignas(32) float rest[8];
+			next8(rest);
+			for (size_t j = 0; i < count; i++, j++)
+				out[i] = rest[j];
+		}
+	}
+
+private:
+	alignas(32) uint32_t s[4][8];
+
+#if defined(__AVX2__)
+	inline void next8(float* out)
+	{
+		__m256i s0 = _mm256_load_si256((const __m256i*)s[0]);
+		__m256i s1 = _mm256_load_si256((const __m256i*)s[1]);
+		__m256i s2 = _mm256_load_si256((const __m256i*)s[2]);
+		__m256i s3 = _mm256_load_si256((const __m256i*)s[3]);
+
+		__m256i result = _mm256_add_epi32(s0, s3);
+		__m256i t = _mm256_slli_epi32(s1, 9);
+		s2 = _mm256_xor_si256(s2, s0);
+		s3 = _mm256_xor_si256(s3, s1);
+		s1 = _mm256_xor_si256(s1, s2);
+		s0 = _mm256_xor_si256(s0, s3);
+		s2 = _mm256_xor_si256(s2, t);
+		s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+
+		_mm256_store_si256((__m256i*)s[0], s0);
+		_mm256_store_si256((__m256i*)s[1], s1);
+		_mm256_store_si256((__m256i*)s[2], s2);
+		_mm256_store_si256((__m256i*)s[3], s3);
+
+		__m256 f = _mm256_cvtepi32_ps(_mm256_srli_epi32(result, 8));
+		_mm256_storeu_ps(out, _mm256_mul_ps(f, _mm256_set1_ps(0x1.0p-24f)));
+	}
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	inline void next8(float* out)
+	{
+		for (int half = 0; half < 8; half += 4)
+		{
+			__m128i s0 = _mm_load_si128((const __m128i*)(s[0] + half));
+			__m128i s1 = _mm_load_si128((const __m128i*)(s[1] + half));
+			__m128i s2 = _mm_load_si128((const __m128i*)(s[2] + half));
+			__m128i s3 = _mm_load_si128((const __m128i*)(s[3] + half));
+
+			__m128i result = _mm_add_epi32(s0, s3);
+			__m128i t = _mm_slli_epi32(s1, 9);
+			s2 = _mm_xor_si128(s2, s0);
+			s3 = _mm_xor_si128(s3, s1);
+			s1 = _mm_xor_si128(s1, s2);
+			s0 = _mm_xor_si128(s0, s3);
+			s2 = _mm_xor_si128(s2, t);
+			s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+
+			_mm_store_si128((__m128i*)(s[0] + half), s0);
+			_mm_store_si128((__m128i*)(s[1] + half), s1);
+			_mm_store_si128((__m128i*)(s[2] + half), s2);
+			_mm_store_si128((__m128i*)(s[3] + half), s3);
+
+			__m128 f = _mm_cvtepi32_ps(_mm_srli_epi32(result, 8));
+			_mm_storeu_ps(out + half, _mm_mul_ps(f, _mm_set1_ps(0x1.0p-24f)));
+		}
+	}
+#else
+	inline void next8(float* out)
+	{
+		for (int lane = 0; lane < 8; lane++)
+		{
+			const uint32_t result = s[0][lane] + s[3][lane];
+			const uint32_t t = s[1][lane] << 9;
+
+			s[2][lane] ^= s[0][lane];
+			s[3][lane] ^= s[1][lane];
+			s[1][lane] ^= s[2][lane];
+			s[0][lane] ^= s[3][lane];
+			s[2][lane] ^= t;
+			s[3][lane] = (s[3][lane] << 11) | (s[3][lane] >> 21);
+
+			out[lane] = (result >> 8) * 0x1.0p-24f;
+		}
+	}
+#endif
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "rng.h"
+
+enum class sampler_type
+{
+	independent,
+	sobol,
+	pmj02
+};
+
+// sampler used by samples started with start_sample
+inline sampler_type default_sampler = sampler_type::independent;
+
+// hands out the dimensions of one pixel sample. the camera owns the first dimensions and every path
+// vertex a fixed block after them, so a dimension stands for the same decision in every sample of
+// the pixel, which is what makes low discrepancy points pay off. draws past the end of a block,
+// like the tail of a rejection loop, come from an independent stream.
+//
+// the points are hash based owen scrambled sobol points (burley 2020, "practical hash-based owen
+// scrambling"), the index is shuffled per dimension so that dimensions do not correlate.
+// sobol pads single dimensions of the van der corput sequence, pmj02 pads pairs of dimensions of
+// the 2d sobol (0,2)-sequence, which owen scrambled is a progressive multi-jittered (0,2)
+// sequence (helmer et al. 2021), so the 2d samples of a vertex are stratified jointly
+class path_sampler
+{
+public:
+	static constexpr uint32_t camera_dimensions = 2;
+	static constexpr uint32_t vertex_dimensions = 8;
+
+	void start_sample(sampler_type sample_type, uint32_t pixel_index, uint32_t sample_index, uint32_t seed)
+	{
+		type = sample_type;
+		pixel_seed = hash32(pixel_index);
+		reversed_index = reverse_bits(sample_index);
+		base_seed = seed;
+		dimension = 0;
+		block_end = camera_dimensions;
+		fallback.seed(seed);
+	}
+
+	// a plain random stream, start_vertex keeps it independent
+	void start_stream(uint32_t seed)
+	{
+		type = sampler_type::independent;
+		base_seed = seed;
+		fallback.seed(seed);
+	}
+
+	// paths shaded a bounce at a time by different threads restart at their vertex's block
+	void start_vertex(int vertex)
+	{
+		dimension = camera_dimensions + vertex * vertex_dimensions;
+		block_end = dimension + vertex_dimensions;
+		fallback.seed(mix_bits(((uint64_t)base_seed << 32) | (uint32_t)(vertex + 1)));
+	}
+
+	inline float next()
+	{
+		if (type == sampler_type::independent || dimension >= block_end)
+			return fallback.next_float();
+
+		// nested_uniform_scramble(x) is reverse_bits(laine_karras_permutation(reverse_bits(x))),
+		// the reversals cancelling between the steps below are left out
+		uint32_t d = dimension++;
+		uint32_t bits;
+		if (type == sampler_type::sobol)
+		{
+			// shuffle the index, take its van der corput point and scramble that
+			uint32_t shuffled = reverse_bits(laine_karras_permutation(reversed_index, hash(d, 0)));
+			bits = reverse_bits(laine_karras_permutation(shuffled, hash(d, 1)));
+		}
+		else
+		{
+			// both dimensions of a pair share the shuffled index
+			if ((d & 1) == 0)
+				pair_index = reverse_bits(laine_karras_permutation(reversed_index, hash(d >> 1, 2)));
+			uint32_t reversed_point = (d & 1) ? reverse_bits(sobol_second(pair_index)) : pair_index;
+			bits = reverse_bits(laine_karras_permutation(reversed_point, hash(d, 3)));
+		}
+
+		return (bits >> 8) * 0x1.0p-24f;
+	}
+
+private:
+	sampler_type type = sampler_type::independent;
+	uint32_t pixel_seed = 0;
+	uint32_t reversed_index = 0;
+	uint32_t pair_index = 0;
+	uint32_t base_seed = 0;
+	uint32_t dimension = 0;
+	uint32_t block_end = 0;
+	xoshiro128p fallback;
+
+	static inline uint32_t hash32(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x21F0AAADu;
+		x ^= x >> 15;
+		x *= 0xD35A2D97u;
+		x ^= x >> 15;
+		return x;
+	}
+
+	// one scramble per pixel, dimension and use
+	inline uint32_t hash(uint32_t d, uint32_t use) const
+	{
+		return hash32(pixel_seed ^ ((d * 4 + use) * 0x9E3779B9u));
+	}
+
+	static inline uint32_t reverse_bits(uint32_t x)
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+		x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	static inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+	{
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return x;
+	}
+
+	struct sobol_second_table
+	{
+		uint32_t bytes[4][256];
+
+		// second dimension of the sobol sequence, its direction numbers are v_k = v_{k-1} ^ (v_{k-1} >> 1).
+		// the point is linear in the bits of the index, so it is the xor of one entry per index byte
+		sobol_second_table()
+		{
+			uint32_t directions[32];
+			directions[0] = 1u << 31;
+			for (int k = 1; k < 32; k++)
+				directions[k] = directions[k - 1] ^ (directions[k - 1] >> 1);
+
+			for (int b = 0; b < 4; b++)
+			{
+				for (uint32_t value = 0; value < 256; value++)
+				{
+					uint32_t result = 0;
+					for (int k = 0; k < 8; k++)
+					{
+						if (value & (1u << k))
+							result ^= directions[8 * b + k];
+					}
+					bytes[b][value] = result;
+				}
+			}
+		}
+	};
+
+	static inline uint32_t sobol_second(uint32_t i)
+	{
+		static const sobol_second_table table;
+		return table.bytes[0][i & 0xFF] ^ table.bytes[1][(i >> 8) & 0xFF] ^ table.bytes[2][(i >> 16) & 0xFF] ^ table.bytes[3][i >> 24];
+	}
+};
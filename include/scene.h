@@ -9,6 +9,19 @@
 #include "cdf.h"
 
 #include <vector>
+#include <memory>
+#include <mutex>
+
+// last triangle block that blocked a shadow ray toward each light, kept per thread
+// because neighbouring shadow rays tend to be blocked by the same geometry
+struct occluder_cache
+{
+	std::vector<uint32_t> blocks;
+
+	uint64_t queries = 0;
+	uint64_t occluded = 0;
+	uint64_t hits = 0;		// occluded queries answered by the cached block
+};
 
 class Scene
 {
@@ -18,6 +31,18 @@ public:
 	bool intersect_fast(const ray& r, fType t_min, fType t_max) const;
 	bool intersect(const ray& r, hit_record& rec, fType t_min = Epsilon, fType t_max = infinity) const;
 
+	// shadow ray toward the given light, stops at the first occluder
+	bool occluded(const ray& r, fType dist, size_t light) const;
+	void print_occluder_stats() const;
+	// zeroes the counters, not the cached blocks, so each frame reports its own rays
+	void reset_occluder_stats() const;
+
+	// packets of up to N coherent rays, hits[i] / occluded[i] report lane i
+	template <int N>
+	void intersect_packet(const ray* rays, int count, hit_record* recs, bool* hits, fType t_min = Epsilon, fType t_max = infinity) const;
+	template <int N>
+	void intersect_fast_packet(const ray* rays, int count, const fType* t_max, bool* occluded, fType t_min = Epsilon) const;
+
 // 	void add_hittable(shared_ptr<hittable> obj)
 // 	{
 // 		shapes.push_back(obj);
@@ -25,6 +50,17 @@ public:
 // 		temp_hittable_list.push_back(obj);
 // 	}
 
+	// a bvh built earlier over the triangles of the models added next, init() then builds nothing
+	void use_bvh(shared_ptr<bvh> prebuilt)
+	{
+		bvh_root = prebuilt;
+	}
+
+	const bvh& get_bvh() const
+	{
+		return *bvh_root;
+	}
+
 	void add_model(shared_ptr<model> obj)
 	{
 		for (int i = 0; i < obj->objects.size(); i++)
@@ -33,15 +69,22 @@ public:
 
 			uint32_t shapeIndex = shapes.size();
 			shapes.push_back(mesh_ptr);
+			shape_meshes.push_back(mesh_ptr.get());
 			triangleFlag.push_back(true);
 
+			if (bvh_root)
+				continue;
+
 			const std::vector<point3>& vertices = mesh_ptr->vertices;
-			for (int j = 0; j < mesh_ptr->objects.size(); j++)
+			for (uint32_t j = 0; j < mesh_ptr->triangles.size(); j++)
 			{
-				shared_ptr<triangle> tri_ptr = std::dynamic_pointer_cast<triangle>(mesh_ptr->objects[j]);
-				tri_ptr->preCompute(shapeIndex, j, vertices);
+				const triangle& tri = mesh_ptr->triangles[j];
+
+				tri_accel accel;
+				tri.preCompute(accel, shapeIndex, j, vertices);
 
-				temp_hittable_list.push_back(tri_ptr);
+				temp_triangles.push_back(accel);
+				temp_bounds.push_back(tri.bounding_box(vertices));
 			}
 		}
 	}
@@ -53,8 +96,25 @@ public:
 		//buid bvh
 		clock_t start_time = clock();
 
-		bvh_root = make_shared<bvh>(temp_hittable_list);
-		temp_hittable_list.swap(std::vector<shared_ptr<hittable>> ());
+		if (!bvh_root)
+		{
+			bvh_root = make_shared<bvh>(temp_triangles, temp_bounds, bvh_config);
+			std::vector<tri_accel>().swap(temp_triangles);
+			std::vector<aabb>().swap(temp_bounds);
+		}
+
+		size_t triangle_count = 0;
+		for (auto& shape : shapes)
+			triangle_count += std::dynamic_pointer_cast<mesh>(shape)->triangles.size();
+
+		if (triangle_count > 0)
+		{
+			size_t index_bytes = triangle_count * sizeof(triangle);
+			INFO("%zu triangles, %.1f bytes per triangle (%.1f bvh + %.1f indices)", triangle_count,
+				static_cast<float>(bvh_root->memory_bytes() + index_bytes) / triangle_count,
+				static_cast<float>(bvh_root->memory_bytes()) / triangle_count,
+				static_cast<float>(index_bytes) / triangle_count);
+		}
 
 		//build lights cdf
 		int lightCount = lights->objects.size();
@@ -65,6 +125,7 @@ public:
 			for (auto obj : lights->objects)
 			{
 				auto light = std::dynamic_pointer_cast<mesh>(obj);
+				light_meshes.push_back(light.get());
 				light->prepareSamplingTable();
 				m_cdf->append(light->getSamplingWeight());
 			}
@@ -82,9 +143,27 @@ public:
 	{
 		// Randomly pick an emitter
 		fType light_pdf;
-		size_t index = m_cdf->sample(random_value(), light_pdf);
+		size_t index = pickLight(light_pdf);
+
+		fType dist;
+		color value = sampleLight(index, light_pdf, ori_p, ori_normal, light_dir, sample_pdf, dist);
+		if (!value.near_zero() && occluded(ray(ori_p, light_dir), dist, index))
+			return color(0.0);
+
+		return value;
+	}
+
+	size_t pickLight(fType& light_pdf) const
+	{
+		return m_cdf->sample(random_value(), light_pdf);
+	}
+
+	// unshadowed contribution of a point sampled on the given emitter,
+	// the caller tests the shadow ray toward it up to dist
+	color sampleLight(size_t index, fType light_pdf, const point3& ori_p, const vec3& ori_normal, vec3& light_dir, fType& sample_pdf, fType& dist) const
+	{
 		//TODO support other type light
-		auto light_ptr = std::dynamic_pointer_cast<mesh>(lights->objects[index]);
+		mesh* light_ptr = light_meshes[index];
 
 		// Sample on a random point on selected light's surface
 		hit_record light_rec;
@@ -92,47 +171,62 @@ public:
 
 		if (sample_pdf > 1e-6) 
 		{
-			ray r(ori_p, light_dir);
-			fType dist = light_rec.t * (1.0 - Epsilon);
-			if (intersect_fast(r, Epsilon, dist))
-				return color(0.0);
-
+			dist = light_rec.t * (1.0 - Epsilon);
 			sample_pdf *= light_pdf;
 			value /= light_pdf;
 
 			return value;
 		}
 
+		dist = 0.0;
 		return color(0.0);
 	}
 
+	shared_ptr<aabb> bounding_box() const
+	{
+		return bvh_root->bounding_box();
+	}
+
 	fType pdfLightDirect(const hit_record& rec, const vec3& dir)
 	{
 		//TODO support other type light
-		auto light = std::dynamic_pointer_cast<mesh>(rec.shape_ptr);
+		const mesh* light = static_cast<const mesh*>(rec.shape_ptr);
 
 		fType pdfDirect = light->pdfPosition() * (rec.t * rec.t) / std::abs(dot(dir, rec.normal));
 		return pdfDirect * light->getSamplingWeight() * m_cdf->getNormalization();
 	}
 
 private:
+	void fill_hit_record(const ray& r, const hit_cache& cache, hit_record& rec) const;
+	occluder_cache& thread_occluders() const;
+
 	bool inited;
 
 	//used for build bvh
-	std::vector<shared_ptr<hittable>> temp_hittable_list;
+	std::vector<tri_accel> temp_triangles;
+	std::vector<aabb> temp_bounds;
 
 	//stores all obj's pointer
 	std::vector<shared_ptr<hittable>> shapes;
 	std::vector<bool> triangleFlag;
 
+	//raw view of shapes for the hot path, nullptr for shapes that are not meshes
+	std::vector<const mesh*> shape_meshes;
+
 	shared_ptr<bvh> bvh_root;
 
 	//used for sampling lights
 	shared_ptr<cdf> m_cdf;
+	std::vector<mesh*> light_meshes;
+
+	mutable std::mutex occluder_mutex;
+	mutable std::vector<std::unique_ptr<occluder_cache>> occluder_caches;
 
 public:
 	color background;
 	shared_ptr<hittable_list> lights;
+
+	bvh_build_config bvh_config;
 };
 
 bool Scene::intersect_fast(const ray& r, fType t_min, fType t_max) const
@@ -148,29 +242,117 @@ bool Scene::intersect(const ray& r, hit_record& rec, fType t_min, fType t_max) c
 	hit_cache cache;
 	if (bvh_root->hit(r, t_min, t_max, cache))
 	{
-		//fill hit record
-		shared_ptr<hittable> shape = shapes[cache.shapeIndex];
-		if (triangleFlag[cache.shapeIndex])
-		{
-			//triangle
-			shared_ptr<mesh> mesh_ptr = std::dynamic_pointer_cast<mesh>(shape);
-			shared_ptr<triangle> tri_ptr = std::dynamic_pointer_cast<triangle>(mesh_ptr->objects[cache.primIndex]);
-
-			tri_ptr->fill_hit_record(r, cache, rec, mesh_ptr->vertices, mesh_ptr->normals, mesh_ptr->texcoords);
-			rec.shape_ptr = shape;
-			rec.mat_ptr = mesh_ptr->mat_ptr;
-			rec.hit_light = mesh_ptr->is_light;
-		}
-		else
-		{
-			//other shape
-			//TODO
-			exit(1);
-		}
+		fill_hit_record(r, cache, rec);
+		return true;
+	}
 
+	return false;
+}
+
+template <int N>
+void Scene::intersect_packet(const ray* rays, int count, hit_record* recs, bool* hits, fType t_min, fType t_max) const
+{
+	hit_cache caches[N];
+	uint32_t mask = bvh_root->hit_packet<N>(rays, count, t_min, t_max, caches);
+	for (int i = 0; i < count; i++)
+	{
+		hits[i] = (mask & (1u << i)) != 0;
+		if (hits[i])
+			fill_hit_record(rays[i], caches[i], recs[i]);
+	}
+}
+
+template <int N>
+void Scene::intersect_fast_packet(const ray* rays, int count, const fType* t_max, bool* occluded, fType t_min) const
+{
+	uint32_t mask = bvh_root->hit_fast_packet<N>(rays, count, t_min, t_max);
+	for (int i = 0; i < count; i++)
+		occluded[i] = (mask & (1u << i)) != 0;
+}
+
+bool Scene::occluded(const ray& r, fType dist, size_t light) const
+{
+	occluder_cache& cache = thread_occluders();
+	cache.queries++;
+
+	uint32_t& last = cache.blocks[light];
+	if (last != bvh::no_occluder && bvh_root->occluded_by(last, r, Epsilon, dist))
+	{
+		cache.occluded++;
+		cache.hits++;
 		return true;
 	}
 
+	// an unoccluded ray forgets the occluder, its neighbours are likely lit as well
+	last = bvh_root->find_occluder(r, Epsilon, dist);
+	if (last != bvh::no_occluder)
+	{
+		cache.occluded++;
+		return true;
+	}
 
 	return false;
+}
+
+occluder_cache& Scene::thread_occluders() const
+{
+	thread_local const Scene* owner = nullptr;
+	thread_local occluder_cache* cache = nullptr;
+	if (owner != this)
+	{
+		std::lock_guard<std::mutex> lock(occluder_mutex);
+		occluder_caches.push_back(std::make_unique<occluder_cache>());
+		cache = occluder_caches.back().get();
+		cache->blocks.assign(light_meshes.size(), bvh::no_occluder);
+		owner = this;
+	}
+
+	return *cache;
+}
+
+void Scene::print_occluder_stats() const
+{
+	uint64_t queries = 0, occluded = 0, hits = 0;
+	{
+		std::lock_guard<std::mutex> lock(occluder_mutex);
+		for (auto& cache : occluder_caches)
+		{
+			queries += cache->queries;
+			occluded += cache->occluded;
+			hits += cache->hits;
+		}
+	}
+
+	if (queries > 0)
+		INFO("shadow rays: %llu, occluded %.1f%%, occluder cache hits %.1f%% of occluded rays (%.1f%% of all)",
+			(unsigned long long)queries, 100.0f * occluded / queries,
+			occluded > 0 ? 100.0f * hits / occluded : 0.0f, 100.0f * hits / queries);
+}
+
+void Scene::reset_occluder_stats() const
+{
+	std::lock_guard<std::mutex> lock(occluder_mutex);
+	for (auto& cache : occluder_caches)
+		cache->queries = cache->occluded = cache->hits = 0;
+}
+
+void Scene::fill_hit_record(const ray& r, const hit_cache& cache, hit_record& rec) const
+{
+	if (triangleFlag[cache.shapeIndex])
+	{
+		//triangle
+		const mesh* mesh_ptr = shape_meshes[cache.shapeIndex];
+		const triangle& tri = mesh_ptr->triangles[cache.primIndex];
+
+		tri.fill_hit_record(r, cache, rec, mesh_ptr->vertices, mesh_ptr->normals, mesh_ptr->texcoords);
+		rec.shape_ptr = mesh_ptr;
+		rec.mat_ptr = mesh_ptr->mat_ptr.get();
+		rec.hit_light = mesh_ptr->is_light;
+	}
+	else
+	{
+		//other shape
+		//TODO
+		exit(1);
+	}
 }
\ No newline at end of file
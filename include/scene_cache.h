@@ -0,0 +1,367 @@
+#pragma once
+
+#include "common.h"
+#include "model.h"
+#include "scene.h"
+#include "mapped_file.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+// binary image of a loaded scene written next to its obj: the parsed materials, the welded meshes
+// and the flattened bvh with its TriAccel blocks. a later run maps it and traverses the bvh in
+// place, so startup neither parses the obj nor welds vertices nor builds the tree.
+// arrays start on 64 byte boundaries so the mapped nodes and blocks are aligned like built ones
+const uint32_t scene_cache_version = 1;
+
+struct scene_cache_header
+{
+	char magic[4];
+	uint32_t version;
+
+	// layout of the stored structs, which depends on the build (fp32, avx2 block width)
+	uint32_t ftype_size;
+	uint32_t tri_block_width;
+	uint32_t tri_block_size;
+	uint32_t bvh_node_size;
+	uint32_t wide4_size;
+	uint32_t wide8_size;
+
+	// sizes and modification times of the obj and the mtl files beside it
+	uint64_t source_key;
+
+	// bvh options, a tree built with others is rebuilt
+	uint32_t split_method;
+	uint32_t leaf_capacity;
+	uint32_t bin_count;
+	uint32_t width;
+	float traversal_cost;
+	float leaf_cost;
+
+	uint64_t file_size;
+};
+
+inline scene_cache_header make_scene_cache_header(const std::string& obj_path, const bvh_build_config& config)
+{
+	scene_cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "RGSC", 4);
+	header.version = scene_cache_version;
+	header.ftype_size = sizeof(fType);
+	header.tri_block_width = tri_block_width;
+	header.tri_block_size = sizeof(tri_block);
+	header.bvh_node_size = sizeof(bvh_node);
+	header.wide4_size = sizeof(wide_bvh_node<4>);
+	header.wide8_size = sizeof(wide_bvh_node<8>);
+
+	// materials may live in any mtl file of the obj's directory
+	namespace fs = std::filesystem;
+	std::error_code ec;
+	uint64_t key = 0;
+	auto add_file = [&](const fs::path& path)
+		{
+			uint64_t size = fs::file_size(path, ec);
+			uint64_t time = static_cast<uint64_t>(fs::last_write_time(path, ec).time_since_epoch().count());
+			key = mix_bits(key ^ mix_bits(size + 0x9E3779B97F4A7C15ull) ^ (time * 0xBF58476D1CE4E5B9ull));
+		};
+	add_file(obj_path);
+	std::vector<fs::path> mtl_files;
+	for (fs::directory_iterator it(fs::path(obj_path).parent_path(), ec), end; !ec && it != end; it.increment(ec))
+	{
+		if (it->path().extension() == ".mtl")
+			mtl_files.push_back(it->path());
+	}
+	std::sort(mtl_files.begin(), mtl_files.end());
+	for (const fs::path& path : mtl_files)
+		add_file(path);
+	header.source_key = key;
+
+	header.split_method = static_cast<uint32_t>(config.split_method);
+	header.leaf_capacity = config.leaf_capacity;
+	header.bin_count = config.bin_count;
+	header.width = config.width;
+	header.traversal_cost = static_cast<float>(config.traversal_cost);
+	header.leaf_cost = static_cast<float>(config.leaf_cost);
+	return header;
+}
+
+class scene_cache_writer
+{
+public:
+	std::vector<unsigned char> bytes;
+
+	void put(const void* data, size_t size)
+	{
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		bytes.insert(bytes.end(), p, p + size);
+	}
+
+	template <typename T>
+	void put_value(const T& value)
+	{
+		put(&value, sizeof(T));
+	}
+
+	void put_string(const std::string& value)
+	{
+		put_value(static_cast<uint32_t>(value.size()));
+		put(value.data(), value.size());
+	}
+
+	template <typename T>
+	void put_array(const T* data, size_t count)
+	{
+		put_value(static_cast<uint64_t>(count));
+		bytes.resize((bytes.size() + 63) & ~size_t(63), 0);
+		put(data, count * sizeof(T));
+	}
+};
+
+class scene_cache_reader
+{
+public:
+	scene_cache_reader(const unsigned char* begin, const unsigned char* end) : base(begin), cursor(begin), end(end) {}
+
+	bool ok = true;
+
+	void get(void* data, size_t size)
+	{
+		if (!ok || size > size_t(end - cursor))
+		{
+			ok = false;
+			memset(data, 0, size);
+			return;
+		}
+		memcpy(data, cursor, size);
+		cursor += size;
+	}
+
+	template <typename T>
+	T get_value()
+	{
+		T value;
+		get(&value, sizeof(T));
+		return value;
+	}
+
+	std::string get_string()
+	{
+		uint32_t size = get_value<uint32_t>();
+		if (!ok || size > size_t(end - cursor))
+		{
+			ok = false;
+			return std::string();
+		}
+		std::string value(reinterpret_cast<const char*>(cursor), size);
+		cursor += size;
+		return value;
+	}
+
+	// points into the mapped file, nothing is copied
+	template <typename T>
+	array_view<T> get_array()
+	{
+		uint64_t count = get_value<uint64_t>();
+		size_t offset = (size_t(cursor - base) + 63) & ~size_t(63);
+		if (!ok || offset > size_t(end - base) || count > (size_t(end - base) - offset) / sizeof(T))
+		{
+			ok = false;
+			return array_view<T>();
+		}
+		cursor = base + offset + count * sizeof(T);
+		return array_view<T>(reinterpret_cast<const T*>(base + offset), count);
+	}
+
+private:
+	const unsigned char* base;
+	const unsigned char* cursor;
+	const unsigned char* end;
+};
+
+inline bool save_scene_cache(const std::string& path, const std::string& obj_path, const model& obj, const Scene& scene, const bvh_build_config& config)
+{
+	scene_cache_writer writer;
+	scene_cache_header header = make_scene_cache_header(obj_path, config);
+	writer.put_value(header);
+
+	writer.put_value(static_cast<uint32_t>(obj.source_materials.size()));
+	for (const tinyobj::material_t& m : obj.source_materials)
+	{
+		writer.put_string(m.name);
+		writer.put_string(m.diffuse_texname);
+		writer.put_string(m.specular_texname);
+		writer.put_value(m.ior);
+		writer.put(m.diffuse, sizeof(m.diffuse));
+		writer.put(m.specular, sizeof(m.specular));
+		writer.put_value(m.shininess);
+	}
+
+	writer.put_value(static_cast<uint32_t>(obj.objects.size()));
+	for (const shared_ptr<hittable>& object : obj.objects)
+	{
+		const mesh* m = static_cast<const mesh*>(object.get());
+		int32_t material_index = static_cast<int32_t>(std::find(obj.materials.begin(), obj.materials.end(), m->mat_ptr) - obj.materials.begin());
+		writer.put_string(m->name);
+		writer.put_value(material_index);
+		writer.put_array(m->triangles.data(), m->triangles.size());
+		writer.put_array(m->vertices.data(), m->vertices.size());
+		writer.put_array(m->normals.data(), m->normals.size());
+		writer.put_array(m->texcoords.data(), m->texcoords.size());
+	}
+
+	bvh_arrays arrays = scene.get_bvh().arrays();
+	writer.put_value(arrays.width);
+	writer.put_value(arrays.sah_cost);
+	writer.put_value(arrays.node_count);
+	writer.put_value(arrays.leaf_count);
+	writer.put_value(arrays.bounds.minimum);
+	writer.put_value(arrays.bounds.maximum);
+	writer.put_array(arrays.blocks.data(), arrays.blocks.size());
+	writer.put_array(arrays.nodes.data(), arrays.nodes.size());
+	writer.put_array(arrays.nodes4.data(), arrays.nodes4.size());
+	writer.put_array(arrays.nodes8.data(), arrays.nodes8.size());
+
+	header.file_size = writer.bytes.size();
+	memcpy(writer.bytes.data(), &header, sizeof(header));
+
+	// written aside and moved over the old one, a run mapping the old cache keeps its pages
+	std::string temp_path = path + ".tmp";
+	FILE* file = fopen(temp_path.c_str(), "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(writer.bytes.data(), 1, writer.bytes.size(), file) == writer.bytes.size();
+	ok = fclose(file) == 0 && ok;
+
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(temp_path, path, ec);
+	return ok && !ec;
+}
+
+// fills obj and scene from the cache at path, false when there is none or it was built from other
+// sources, by another build or with other bvh options. lights are found through the xml as usual
+inline bool load_scene_cache(const std::string& path, const std::string& obj_path, model& obj, Scene& scene,
+	shared_ptr<hittable_list> lights, std::map<std::string, vec3>& matname2radiance, const bvh_build_config& config, job_graph& jobs)
+{
+	std::error_code ec;
+	if (!std::filesystem::exists(path, ec))
+		return false;
+
+	std::shared_ptr<mapped_file> file = mapped_file::open(path);
+	scene_cache_header expected = make_scene_cache_header(obj_path, config);
+	scene_cache_header header;
+	if (!file || file->size() < sizeof(header))
+	{
+		WARN("failed to map scene cache %s, loading the obj.", path.c_str());
+		return false;
+	}
+	memcpy(&header, file->data(), sizeof(header));
+	expected.file_size = file->size();
+	if (memcmp(&header, &expected, sizeof(header)) != 0)
+	{
+		WARN("scene cache %s is stale or was written by another build or with other bvh options, loading the obj.", path.c_str());
+		return false;
+	}
+
+	scene_cache_reader reader(file->data(), file->data() + file->size());
+	reader.get(&header, sizeof(header));
+
+	std::vector<tinyobj::material_t> inmaterials(reader.get_value<uint32_t>());
+	for (tinyobj::material_t& m : inmaterials)
+	{
+		if (!reader.ok)
+			break;
+		m.name = reader.get_string();
+		m.diffuse_texname = reader.get_string();
+		m.specular_texname = reader.get_string();
+		m.ior = reader.get_value<tinyobj::real_t>();
+		reader.get(m.diffuse, sizeof(m.diffuse));
+		reader.get(m.specular, sizeof(m.specular));
+		m.shininess = reader.get_value<tinyobj::real_t>();
+	}
+
+	struct cached_mesh
+	{
+		std::string name;
+		int32_t material_index;
+		array_view<triangle> triangles;
+		array_view<point3> vertices;
+		array_view<point3> normals;
+		array_view<point2> texcoords;
+	};
+	std::vector<cached_mesh> meshes(reader.ok ? reader.get_value<uint32_t>() : 0);
+	for (cached_mesh& m : meshes)
+	{
+		m.name = reader.get_string();
+		m.material_index = reader.get_value<int32_t>();
+		m.triangles = reader.get_array<triangle>();
+		m.vertices = reader.get_array<point3>();
+		m.normals = reader.get_array<point3>();
+		m.texcoords = reader.get_array<point2>();
+		if (!reader.ok)
+			break;
+	}
+
+	bvh_arrays arrays;
+	arrays.width = reader.get_value<uint32_t>();
+	arrays.sah_cost = reader.get_value<fType>();
+	arrays.node_count = reader.get_value<uint32_t>();
+	arrays.leaf_count = reader.get_value<uint32_t>();
+	arrays.bounds.minimum = reader.get_value<point3>();
+	arrays.bounds.maximum = reader.get_value<point3>();
+	arrays.blocks = reader.get_array<tri_block>();
+	arrays.nodes = reader.get_array<bvh_node>();
+	arrays.nodes4 = reader.get_array<wide_bvh_node<4>>();
+	arrays.nodes8 = reader.get_array<wide_bvh_node<8>>();
+	if (!reader.ok)
+	{
+		WARN("scene cache %s is truncated, loading the obj.", path.c_str());
+		return false;
+	}
+
+	obj.setPath(obj_path);
+	std::vector<int> light_mat_index;
+	obj.loadMaterials(inmaterials, matname2radiance, light_mat_index, jobs);
+	obj.source_materials = inmaterials;
+
+	for (const cached_mesh& m : meshes)
+	{
+		if (m.material_index < 0 || m.material_index >= (int32_t)obj.materials.size())
+		{
+			// loadObj starts over, the texture jobs already queued finish on their own
+			WARN("scene cache %s refers to a missing material, loading the obj.", path.c_str());
+			obj.materials.clear();
+			obj.textures.clear();
+			obj.loaded_textures.clear();
+			return false;
+		}
+	}
+
+	// the meshes are small next to the bvh and are copied, the triangle routines work on vectors
+	for (const cached_mesh& m : meshes)
+	{
+		std::string name = m.name;
+		shared_ptr<mesh> mesh_ptr = make_shared<mesh>(name, obj.materials[m.material_index]);
+		mesh_ptr->vertices.assign(m.vertices.data(), m.vertices.data() + m.vertices.size());
+		mesh_ptr->normals.assign(m.normals.data(), m.normals.data() + m.normals.size());
+		mesh_ptr->texcoords.assign(m.texcoords.data(), m.texcoords.data() + m.texcoords.size());
+		mesh_ptr->triangles.reserve(m.triangles.size());
+		for (size_t i = 0; i < m.triangles.size(); i++)
+			mesh_ptr->add(m.triangles[i], m.triangles[i].bounding_box(mesh_ptr->vertices));
+
+		obj.add(mesh_ptr);
+		if (std::find(light_mat_index.begin(), light_mat_index.end(), m.material_index) != light_mat_index.end())
+		{
+			mesh_ptr->is_light = true;
+			lights->add(mesh_ptr);
+		}
+	}
+
+	scene.use_bvh(make_shared<bvh>(arrays, file));
+	INFO("loaded %zu meshes and a bvh of %u nodes from scene cache %s", meshes.size(), arrays.node_count, path.c_str());
+	return true;
+}
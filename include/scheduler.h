@@ -0,0 +1,259 @@
+#pragma once
+
+#include "common.h"
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <omp.h>
+
+enum class tile_order
+{
+	scanline,
+	morton,
+	hilbert
+};
+
+struct tile_scheduler_config
+{
+	int tile_size = 16;
+	// 0 uses every thread openmp would
+	int thread_count = 0;
+	tile_order order = tile_order::hilbert;
+	// how often the reporter thread prints the progress, callers printing their own can turn it off
+	int report_ms = 250;
+	bool report_progress = true;
+};
+
+// pixels [x0, x1) x [y0, y1)
+struct render_tile
+{
+	int x0, y0, x1, y1;
+};
+
+// splits the image into tiles laid along a space filling curve and hands every thread a contiguous
+// run of it. a thread takes its own tiles from the front of its deque and, once it runs dry, steals
+// from the back of the others, so threads stuck with expensive tiles are helped out by the rest
+class tile_scheduler
+{
+public:
+	tile_scheduler(const tile_scheduler_config& config) : config(config) {}
+
+	// calls render(tile) once for every tile of the image
+	template <typename F>
+	void run(int image_width, int image_height, F&& render)
+	{
+		run(render_tile{ 0, 0, image_width, image_height }, render);
+	}
+
+	// only the tiles of region, tiles are laid out from its corner
+	template <typename F>
+	void run(const render_tile& region, F&& render)
+	{
+		std::vector<render_tile> tiles = make_tiles(region);
+		int threads = config.thread_count > 0 ? config.thread_count : omp_get_max_threads();
+		distribute(tiles, threads);
+
+		const uint64_t total_pixels = (uint64_t)(region.x1 - region.x0) * (region.y1 - region.y0);
+		bool finished = false;
+		std::mutex report_mutex;
+		std::condition_variable report_cv;
+
+		// the only thread writing to stdout while rendering, workers just bump their own counter
+		std::thread reporter([&]()
+			{
+				std::unique_lock<std::mutex> lock(report_mutex);
+				while (!report_cv.wait_for(lock, std::chrono::milliseconds(config.report_ms), [&]() { return finished; }))
+				{
+					if (!config.report_progress)
+						continue;
+
+					printf("\rrendering %.2f%%...", (100.0f * finished_pixels()) / total_pixels);
+					fflush(stdout);
+				}
+			});
+
+#pragma omp parallel num_threads(threads)
+		{
+			int id = omp_get_thread_num();
+			worker& self = workers[id];
+
+			render_tile tile;
+			while (next_tile(id, tile))
+			{
+				render(tile);
+
+				uint64_t pixels = (uint64_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+				self.done_pixels.store(self.done_pixels.load(std::memory_order_relaxed) + pixels, std::memory_order_relaxed);
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(report_mutex);
+			finished = true;
+		}
+		report_cv.notify_one();
+		reporter.join();
+
+		uint64_t stolen = 0;
+		for (int i = 0; i < worker_count; i++)
+			stolen += workers[i].stolen;
+
+		if (!config.report_progress)
+			return;
+
+		printf("\rrendering %.2f%%...\n", (100.0f * finished_pixels()) / total_pixels);
+		INFO("%zu tiles of %dx%d in %s order on %d threads, %llu stolen", tiles.size(), config.tile_size, config.tile_size,
+			order_name(config.order), threads, (unsigned long long)stolen);
+	}
+
+	static const char* order_name(tile_order order)
+	{
+		switch (order)
+		{
+		case tile_order::scanline: return "scanline";
+		case tile_order::morton: return "morton";
+		default: return "hilbert";
+		}
+	}
+
+private:
+	struct alignas(64) worker
+	{
+		std::mutex lock;
+		std::deque<render_tile> tiles;
+		// written by the owner only, read by the reporter
+		std::atomic<uint64_t> done_pixels{ 0 };
+		uint64_t stolen = 0;
+	};
+
+	tile_scheduler_config config;
+	std::unique_ptr<worker[]> workers;
+	int worker_count = 0;
+
+	std::vector<render_tile> make_tiles(const render_tile& region) const
+	{
+		const int size = std::max(1, config.tile_size);
+		const int tiles_x = (region.x1 - region.x0 + size - 1) / size;
+		const int tiles_y = (region.y1 - region.y0 + size - 1) / size;
+
+		uint32_t side = 1;
+		while (side < (uint32_t)std::max(tiles_x, tiles_y))
+			side <<= 1;
+
+		std::vector<std::pair<uint64_t, render_tile>> keyed;
+		keyed.reserve(tiles_x * tiles_y);
+		for (int ty = 0; ty < tiles_y; ty++)
+		{
+			for (int tx = 0; tx < tiles_x; tx++)
+			{
+				uint64_t key;
+				if (config.order == tile_order::morton)
+					key = morton_key(tx, ty);
+				else if (config.order == tile_order::hilbert)
+					key = hilbert_key(side, tx, ty);
+				else
+					key = (uint64_t)ty * tiles_x + tx;
+
+				render_tile tile{ region.x0 + tx * size, region.y0 + ty * size,
+					std::min(region.x0 + (tx + 1) * size, region.x1), std::min(region.y0 + (ty + 1) * size, region.y1) };
+				keyed.emplace_back(key, tile);
+			}
+		}
+
+		std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+		std::vector<render_tile> tiles;
+		tiles.reserve(keyed.size());
+		for (auto& k : keyed)
+			tiles.push_back(k.second);
+		return tiles;
+	}
+
+	// consecutive runs of the curve, so a thread keeps to one region of the image until it steals
+	void distribute(const std::vector<render_tile>& tiles, int threads)
+	{
+		worker_count = threads;
+		workers.reset(new worker[threads]);
+		for (int i = 0; i < threads; i++)
+		{
+			size_t first = tiles.size() * i / threads;
+			size_t last = tiles.size() * (i + 1) / threads;
+			workers[i].tiles.assign(tiles.begin() + first, tiles.begin() + last);
+		}
+	}
+
+	bool next_tile(int id, render_tile& tile)
+	{
+		{
+			worker& self = workers[id];
+			std::lock_guard<std::mutex> lock(self.lock);
+			if (!self.tiles.empty())
+			{
+				tile = self.tiles.front();
+				self.tiles.pop_front();
+				return true;
+			}
+		}
+
+		// tiles are never added while rendering, so once every deque is empty the image is done
+		for (int i = 1; i < worker_count; i++)
+		{
+			worker& victim = workers[(id + i) % worker_count];
+			std::lock_guard<std::mutex> lock(victim.lock);
+			if (!victim.tiles.empty())
+			{
+				tile = victim.tiles.back();
+				victim.tiles.pop_back();
+				workers[id].stolen++;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	uint64_t finished_pixels() const
+	{
+		uint64_t pixels = 0;
+		for (int i = 0; i < worker_count; i++)
+			pixels += workers[i].done_pixels.load(std::memory_order_relaxed);
+		return pixels;
+	}
+
+	static uint64_t morton_key(uint32_t x, uint32_t y)
+	{
+		uint64_t key = 0;
+		for (int b = 0; b < 16; b++)
+			key |= ((uint64_t)((x >> b) & 1) << (2 * b)) | ((uint64_t)((y >> b) & 1) << (2 * b + 1));
+		return key;
+	}
+
+	// distance of (x, y) along the hilbert curve filling a side x side grid
+	static uint64_t hilbert_key(uint32_t side, uint32_t x, uint32_t y)
+	{
+		uint64_t d = 0;
+		for (uint32_t s = side / 2; s > 0; s /= 2)
+		{
+			uint32_t rx = (x & s) > 0;
+			uint32_t ry = (y & s) > 0;
+			d += (uint64_t)s * s * ((3 * rx) ^ ry);
+
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = side - 1 - x;
+					y = side - 1 - y;
+				}
+				std::swap(x, y);
+			}
+		}
+		return d;
+	}
+};
@@ -0,0 +1,240 @@
+#pragma once
+
+#include "common.h"
+#include "tinyexr.h"
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+
+// a shard is a render of part of a frame, a region of its pixels, a range of its sample indices or
+// both. it is written as a full size exr whose B, G, R channels hold the mean of the pixel's samples
+// and whose samples channel holds how many there were, pixels the shard did not render have none.
+// since every sample seeds its own stream, shards of one frame merge into the image a single
+// process would have rendered
+constexpr const char* shard_samples_channel = "samples";
+// first and one past the last sample index of the shard, used to tell overlapping shards apart
+constexpr const char* shard_range_attribute = "ragnarokSampleRange";
+
+// rgb is laid out like the final image, rows from the top, and so are sample_counts
+inline int save_shard(const std::string& path, const float* rgb, const std::vector<int>& sample_counts, int image_width, int image_height,
+	int first_sample, const char** err)
+{
+	const size_t total_pixels = (size_t)image_width * image_height;
+
+	// exr viewers expect the channels sorted by name
+	std::vector<float> channels[4];
+	for (int c = 0; c < 4; c++)
+		channels[c].resize(total_pixels);
+
+	int max_samples = 0;
+	for (size_t i = 0; i < total_pixels; i++)
+	{
+		channels[0][i] = rgb[3 * i + 2];
+		channels[1][i] = rgb[3 * i + 1];
+		channels[2][i] = rgb[3 * i + 0];
+		channels[3][i] = static_cast<float>(sample_counts[i]);
+		max_samples = std::max(max_samples, sample_counts[i]);
+	}
+
+	EXRHeader header;
+	InitEXRHeader(&header);
+	header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+
+	EXRChannelInfo infos[4];
+	int pixel_types[4];
+	const char* names[4] = { "B", "G", "R", shard_samples_channel };
+	memset(infos, 0, sizeof(infos));
+	for (int c = 0; c < 4; c++)
+	{
+		strncpy(infos[c].name, names[c], 255);
+		pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+	}
+	header.num_channels = 4;
+	header.channels = infos;
+	header.pixel_types = pixel_types;
+	header.requested_pixel_types = pixel_types;
+
+	int32_t range[2] = { first_sample, first_sample + max_samples };
+	EXRAttribute attribute;
+	memset(&attribute, 0, sizeof(attribute));
+	strncpy(attribute.name, shard_range_attribute, 255);
+	strncpy(attribute.type, "v2i", 255);
+	attribute.value = reinterpret_cast<unsigned char*>(range);
+	attribute.size = sizeof(range);
+	header.num_custom_attributes = 1;
+	header.custom_attributes = &attribute;
+
+	float* image_ptr[4] = { channels[0].data(), channels[1].data(), channels[2].data(), channels[3].data() };
+	EXRImage image;
+	InitEXRImage(&image);
+	image.num_channels = 4;
+	image.images = reinterpret_cast<unsigned char**>(image_ptr);
+	image.width = image_width;
+	image.height = image_height;
+
+	return SaveEXRImageToFile(&image, &header, path.c_str(), err);
+}
+
+// the pixels of one shard, mean colors and sample counts
+struct shard_image
+{
+	int width = 0, height = 0;
+	int first_sample = 0, end_sample = 0;
+	std::vector<float> rgb;
+	std::vector<float> samples;
+};
+
+inline bool load_shard(const std::string& path, shard_image& shard)
+{
+	const char* err = nullptr;
+	EXRVersion version;
+	EXRHeader header;
+	InitEXRHeader(&header);
+	if (ParseEXRVersionFromFile(&version, path.c_str()) != TINYEXR_SUCCESS
+		|| ParseEXRHeaderFromFile(&header, &version, path.c_str(), &err) != TINYEXR_SUCCESS)
+	{
+		WARN("failed to read %s: %s", path.c_str(), err ? err : "not an exr file");
+		FreeEXRErrorMessage(err);
+		FreeEXRHeader(&header);
+		return false;
+	}
+
+	int channel_index[4] = { -1, -1, -1, -1 };
+	const char* names[4] = { "R", "G", "B", shard_samples_channel };
+	for (int c = 0; c < header.num_channels; c++)
+	{
+		for (int n = 0; n < 4; n++)
+		{
+			if (!strcmp(header.channels[c].name, names[n]))
+				channel_index[n] = c;
+		}
+		if (header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF)
+			header.requested_pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+	}
+
+	shard.first_sample = shard.end_sample = 0;
+	for (int a = 0; a < header.num_custom_attributes; a++)
+	{
+		const EXRAttribute& attribute = header.custom_attributes[a];
+		if (!strcmp(attribute.name, shard_range_attribute) && attribute.size == 2 * sizeof(int32_t))
+		{
+			int32_t range[2];
+			memcpy(range, attribute.value, sizeof(range));
+			shard.first_sample = range[0];
+			shard.end_sample = range[1];
+		}
+	}
+
+	EXRImage image;
+	InitEXRImage(&image);
+	bool ok = std::find(channel_index, channel_index + 4, -1) == channel_index + 4;
+	if (!ok)
+	{
+		WARN("%s has no R, G, B and %s channels, it was not written by a shard render.", path.c_str(), shard_samples_channel);
+	}
+	else if (LoadEXRImageFromFile(&image, &header, path.c_str(), &err) != TINYEXR_SUCCESS)
+	{
+		WARN("failed to read %s: %s", path.c_str(), err);
+		FreeEXRErrorMessage(err);
+		ok = false;
+	}
+	else if (image.tiles || header.pixel_types[channel_index[3]] != TINYEXR_PIXELTYPE_FLOAT)
+	{
+		WARN("%s is not a scanline exr of float channels.", path.c_str());
+		ok = false;
+	}
+
+	if (ok)
+	{
+		shard.width = image.width;
+		shard.height = image.height;
+		const size_t total_pixels = (size_t)image.width * image.height;
+		const float* const* planes = reinterpret_cast<const float* const*>(image.images);
+
+		shard.rgb.resize(3 * total_pixels);
+		shard.samples.assign(planes[channel_index[3]], planes[channel_index[3]] + total_pixels);
+		for (size_t i = 0; i < total_pixels; i++)
+		{
+			for (int c = 0; c < 3; c++)
+				shard.rgb[3 * i + c] = planes[channel_index[c]][i];
+		}
+	}
+
+	FreeEXRImage(&image);
+	FreeEXRHeader(&header);
+	return ok;
+}
+
+// weights every shard's means by its sample counts, rgb gets the mean over all shards and
+// sample_counts their total, both laid out like the final image
+inline bool merge_shards(const std::vector<std::string>& paths, int& image_width, int& image_height, std::vector<float>& rgb,
+	std::vector<int>& sample_counts)
+{
+	std::vector<shard_image> shards(paths.size());
+	for (size_t s = 0; s < paths.size(); s++)
+	{
+		if (!load_shard(paths[s], shards[s]))
+			return false;
+		if (shards[s].width != shards[0].width || shards[s].height != shards[0].height)
+		{
+			WARN("%s is %dx%d but %s is %dx%d, shards of one frame have the same size.", paths[s].c_str(), shards[s].width, shards[s].height,
+				paths[0].c_str(), shards[0].width, shards[0].height);
+			return false;
+		}
+	}
+
+	image_width = shards[0].width;
+	image_height = shards[0].height;
+	const size_t total_pixels = (size_t)image_width * image_height;
+
+	// the same sample of a pixel in two shards would be counted twice
+	for (size_t a = 0; a < shards.size(); a++)
+	{
+		for (size_t b = a + 1; b < shards.size(); b++)
+		{
+			if (shards[a].first_sample >= shards[b].end_sample || shards[b].first_sample >= shards[a].end_sample)
+				continue;
+
+			size_t shared = 0;
+			for (size_t i = 0; i < total_pixels; i++)
+				shared += shards[a].samples[i] > 0 && shards[b].samples[i] > 0;
+			if (shared > 0)
+				WARN("%s and %s both hold samples of [%d, %d) for %zu pixels, they are counted twice.", paths[a].c_str(), paths[b].c_str(),
+					std::max(shards[a].first_sample, shards[b].first_sample), std::min(shards[a].end_sample, shards[b].end_sample), shared);
+		}
+	}
+
+	rgb.assign(3 * total_pixels, 0.0f);
+	sample_counts.assign(total_pixels, 0);
+	size_t uncovered = 0;
+	for (size_t i = 0; i < total_pixels; i++)
+	{
+		double sum[3] = { 0.0, 0.0, 0.0 };
+		double count = 0.0;
+		for (const shard_image& shard : shards)
+		{
+			double samples = shard.samples[i];
+			if (samples == 0)
+				continue;
+			for (int c = 0; c < 3; c++)
+				sum[c] += samples * shard.rgb[3 * i + c];
+			count += samples;
+		}
+
+		if (count == 0)
+		{
+			uncovered++;
+			continue;
+		}
+
+		for (int c = 0; c < 3; c++)
+			rgb[3 * i + c] = static_cast<float>(sum[c] / count);
+		sample_counts[i] = static_cast<int>(count);
+	}
+
+	if (uncovered > 0)
+		WARN("%zu pixels are in none of the shards, they are left black.", uncovered);
+	return true;
+}
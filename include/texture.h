@@ -9,6 +9,8 @@
 #define texture_h
 
 #include <iostream>
+#include <vector>
+#include <memory>
 
 #include "vector2.h"
 #include "common.h"
@@ -18,7 +20,7 @@
 class texture
 {
     public:
-        virtual color value(const vec2& uv, const point3& p) const = 0;
+        virtual color value(const vec2& uv, const point3& p, fType footprint = 0.0) const = 0;
         virtual color getMinimum() const { return color(0.0); }
 		virtual color getMaximum() const { return color(0.0); }
 		virtual color getAverage() const { return color(0.0); }
@@ -33,7 +35,7 @@ class solid_color : public texture
 		solid_color(fType rgb[]) : solid_color(color(rgb[0], rgb[1], rgb[2])) {}
         solid_color(fType red, fType green, fType blue) : solid_color(color(red,green,blue)) {}
 
-        virtual color value(const vec2& uv, const vec3& p) const override
+        virtual color value(const vec2& uv, const vec3& p, fType footprint = 0.0) const override
         {
             return color_value;
         }
@@ -62,70 +64,153 @@ class solid_color : public texture
         color color_value;
 };
 
-//TODO add mipmap
+// linear texels kept as a mip pyramid, level 0 at full resolution and every level below it half
+// the size of the one above down to 1x1. levels are stored as floats whatever fType is, in tiles of
+// tile_size x tile_size texels so the texels of one lookup share cache lines
 class image_texture : public texture
 {
     public:
         const static int bytes_per_pixel = 3;
+        const static int tile_shift = 2;
+        const static int tile_size = 1 << tile_shift;
 
-        image_texture() : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+        image_texture() : raw_data(nullptr), width(0), height(0) {}
 
-        image_texture(const char* filename)
+        image_texture(const char* filename) : image_texture()
+        {
+            decode(filename);
+            linearize();
+            build_mipmaps();
+        }
+
+        // loading is split so startup can run the parts as separate jobs: decode reads the file into
+        // 8 bit pixels, linearize turns them into the linear floats of level 0 and build_mipmaps
+        // filters the levels below it
+        void decode(const char* filename)
         {
             auto components_per_pixel = bytes_per_pixel;
 
-            unsigned char* raw_data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
+            raw_data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
 
             if (!raw_data)
             {
                 WARN("Could not load texture image file %s", filename);
                 exit(1);
             }
+        }
 
-            bytes_per_scanline = bytes_per_pixel * width;
-
-            color minimum(std::numeric_limits<fType>::max());
-            color maximum(-std::numeric_limits<fType>::max());
-            color average(0.0);
-
-			int size = width * height;
-            data = new fType[size * bytes_per_pixel];
+        void linearize()
+        {
+            //invert gamma correction, a byte has only 256 values
+            static const std::vector<fType> linear = []()
+                {
+                    std::vector<fType> table(256);
+                    const fType color_scale = 1.0 / 255.0;
+                    for (int b = 0; b < 256; b++)
+                        table[b] = std::pow(static_cast<fType>(b) * color_scale, 2.2);
+                    return table;
+                }();
+
+            //the tiles of every level are allocated at once and left uninitialized, build_mipmaps fills
+            //in all but level 0. texels past the edges of a level pad its last tiles and are never read
+            levels.clear();
+            size_t tile_count = 0;
+            for (int w = width, h = height; ; w = std::max(1, (w + 1) / 2), h = std::max(1, (h + 1) / 2))
+            {
+                mip_level level;
+                level.width = w;
+                level.height = h;
+                level.tiles_x = (w + tile_size - 1) >> tile_shift;
+                level.first_tile = tile_count;
+                tile_count += (size_t)level.tiles_x * ((h + tile_size - 1) >> tile_shift);
+                levels.push_back(level);
+
+                if (w == 1 && h == 1)
+                    break;
+            }
+            tiles.reset(new texel_tile[tile_count]);
 
-			const fType color_scale = 1.0 / 255.0;
-            for (int i = 0; i < size; i++)
+            //texels are written a tile at a time, the statistics come from how often every byte occurs
+            size_t counts[bytes_per_pixel][256] = {};
+            const mip_level& base = levels[0];
+            for (int ty = 0; ty < height; ty += tile_size)
             {
-                for (int d = 0; d < bytes_per_pixel; d++)
+                for (int tx = 0; tx < width; tx += tile_size)
                 {
-                    int index = i * bytes_per_pixel + d;
-					fType value = static_cast<fType>(raw_data[index]) * color_scale;
-
-                    //invert gamma correction
-                    value = std::pow(value, 2.2);
-
-					minimum[d] = std::min(minimum[d], value);
-                    maximum[d] = std::max(maximum[d], value);
-                    average[d] += value;
-                    data[index] = value;
+                    int columns = std::min(tile_size, width - tx);
+                    for (int y = ty; y < std::min(ty + tile_size, height); y++)
+                    {
+                        const unsigned char* pixel = raw_data + ((size_t)y * width + tx) * bytes_per_pixel;
+                        float* out = texel(base, tx, y);
+                        for (int i = 0; i < columns * bytes_per_pixel; i++)
+                        {
+                            counts[i % bytes_per_pixel][pixel[i]]++;
+                            out[i] = static_cast<float>(linear[pixel[i]]);
+                        }
+                    }
                 }
             }
 
-            m_minimum = minimum;
-            m_maximum = maximum;
-            m_average = average / size;
+            const size_t size = (size_t)width * height;
+            for (int d = 0; d < bytes_per_pixel; d++)
+            {
+                int first = 0, last = 255;
+                while (counts[d][first] == 0) first++;
+                while (counts[d][last] == 0) last--;
+
+                fType sum = 0.0;
+                for (int b = first; b <= last; b++)
+                    sum += counts[d][b] * linear[b];
+
+                m_minimum[d] = linear[first];
+                m_maximum[d] = linear[last];
+                m_average[d] = sum / size;
+            }
 
             stbi_image_free(raw_data);
+            raw_data = nullptr;
+        }
+
+        //every texel is the box filtered 2x2 texels above it, the last row or column of an odd
+        //sized level is taken twice
+        void build_mipmaps()
+        {
+            for (size_t l = 1; l < levels.size(); l++)
+            {
+                const mip_level& above = levels[l - 1];
+                const mip_level& level = levels[l];
+                for (int y = 0; y < level.height; y++)
+                {
+                    int y0 = 2 * y, y1 = std::min(2 * y + 1, above.height - 1);
+                    for (int x = 0; x < level.width; x++)
+                    {
+                        int x0 = 2 * x, x1 = std::min(2 * x + 1, above.width - 1);
+                        const float* a = texel(above, x0, y0);
+                        const float* b = texel(above, x1, y0);
+                        const float* c = texel(above, x0, y1);
+                        const float* e = texel(above, x1, y1);
+
+                        float* out = texel(level, x, y);
+                        for (int d = 0; d < bytes_per_pixel; d++)
+                            out[d] = 0.25f * (a[d] + b[d] + c[d] + e[d]);
+                    }
+                }
+            }
         }
 
         ~image_texture()
         {
-            if (data)
-                delete[] data;
+            if (raw_data)
+                stbi_image_free(raw_data);
         }
 
-        virtual color value(const vec2& uv, const vec3& p) const override
+        // footprint is the width in uv units the lookup covers, the level where it spans one texel is
+        // filtered bilinearly and blended with the next one. footprints below a texel of level 0 read
+        // level 0
+        virtual color value(const vec2& uv, const vec3& p, fType footprint = 0.0) const override
         {
             // If we have no texture data, then return solid cyan as a debugging aid.
-            if (data == nullptr)
+            if (levels.empty())
                 return color(0,1,1);
 
             bool flip_v = true;
@@ -143,15 +228,16 @@ class image_texture : public texture
             if (flip_v)
                 v = 1.0 - v;
 
-            auto i = static_cast<int>(u * width);
-            auto j = static_cast<int>(v * height);
+            const int last = static_cast<int>(levels.size()) - 1;
+            fType level = footprint > 0 ? std::log2(footprint * std::max(width, height)) : 0.0;
+            if (level <= 0)
+                return bilinear(levels[0], u, v);
+            if (level >= last)
+                return bilinear(levels[last], u, v);
 
-            // Clamp integer mapping, since actual coordinates should be less than 1.0
-            if (i >= width)  i = width-1;
-            if (j >= height) j = height-1;
-
-            auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
-            return color(pixel[0], pixel[1], pixel[2]);
+            int l = static_cast<int>(level);
+            fType f = level - l;
+            return (1.0 - f) * bilinear(levels[l], u, v) + f * bilinear(levels[l + 1], u, v);
         }
 
 		virtual color getMinimum() const override
@@ -171,13 +257,16 @@ class image_texture : public texture
 
 		virtual void applyScale(fType scale) override
 		{
-			int size = width * height;
-			for (int i = 0; i < size; i++)
+			for (const mip_level& level : levels)
 			{
-				for (int d = 0; d < bytes_per_pixel; d++)
+				for (int y = 0; y < level.height; y++)
 				{
-					int index = i * bytes_per_pixel + d;
-					data[index] *= scale;
+					for (int x = 0; x < level.width; x++)
+					{
+						float* t = texel(level, x, y);
+						for (int d = 0; d < bytes_per_pixel; d++)
+							t[d] *= scale;
+					}
 				}
 			}
 
@@ -187,15 +276,67 @@ class image_texture : public texture
 		}
 
     private:
+        struct alignas(64) texel_tile
+        {
+            float texels[tile_size * tile_size][bytes_per_pixel];
+        };
+
+        struct mip_level
+        {
+            int width, height;
+            int tiles_x;
+            size_t first_tile;
+        };
+
+        inline float* texel(const mip_level& level, int x, int y)
+        {
+            texel_tile& tile = tiles[level.first_tile + (size_t)(y >> tile_shift) * level.tiles_x + (x >> tile_shift)];
+            return tile.texels[((y & (tile_size - 1)) << tile_shift) | (x & (tile_size - 1))];
+        }
+
+        inline const float* texel(const mip_level& level, int x, int y) const
+        {
+            const texel_tile& tile = tiles[level.first_tile + (size_t)(y >> tile_shift) * level.tiles_x + (x >> tile_shift)];
+            return tile.texels[((y & (tile_size - 1)) << tile_shift) | (x & (tile_size - 1))];
+        }
+
+        // u and v in [0, 1], wraps around the edges like the coordinates do
+        color bilinear(const mip_level& level, fType u, fType v) const
+        {
+            fType x = u * level.width - 0.5;
+            fType y = v * level.height - 0.5;
+            int x0 = static_cast<int>(std::floor(x));
+            int y0 = static_cast<int>(std::floor(y));
+            fType fx = x - x0, fy = y - y0;
+
+            int x1 = x0 + 1, y1 = y0 + 1;
+            if (x0 < 0) x0 += level.width;
+            if (y0 < 0) y0 += level.height;
+            if (x1 >= level.width) x1 -= level.width;
+            if (y1 >= level.height) y1 -= level.height;
+
+            const float* a = texel(level, x0, y0);
+            const float* b = texel(level, x1, y0);
+            const float* c = texel(level, x0, y1);
+            const float* e = texel(level, x1, y1);
+
+            color result;
+            for (int d = 0; d < bytes_per_pixel; d++)
+                result[d] = (1.0 - fy) * ((1.0 - fx) * a[d] + fx * b[d]) + fy * ((1.0 - fx) * c[d] + fx * e[d]);
+            return result;
+        }
+
         color m_minimum;
         color m_maximum;
         color m_average;
 
-    public:
-        fType *data;
+        unsigned char* raw_data;
 
+        std::vector<mip_level> levels;
+        std::unique_ptr<texel_tile[]> tiles;
+
+    public:
         int width, height;
-        int bytes_per_scanline;
 };
 
 #endif /* texture_h */
@@ -14,32 +14,43 @@
 
 #include <vector>
 
+#if defined(USE_AVX2) || defined(USE_SSE)
+#include <immintrin.h>
+#endif
+
 vec2 squareToUniformTriangle(const vec2& sample) 
 {
 	fType a = std::sqrt(1.0 - sample.x);
 	return vec2(1.0 - a, a * sample.y);
 }
 
-class triangle : public hittable
+// Pre-computed triangle representation based on Ingo Wald's TriAccel layout,
+// stored by value in the bvh's leaf order and intersected without virtual calls.
+struct tri_accel
 {
-public:
-	triangle()
-	{
-		aabb_ptr = make_shared<aabb>();
+	uint32_t k;
+	float n_u;
+	float n_v;
+	float n_d;
 
-	}
+	float a_u;
+	float a_v;
+	float b_nu;
+	float b_nv;
+
+	float c_nu;
+	float c_nv;
 
-	int preCompute(uint32_t si, uint32_t pi, const std::vector<point3>& vertices)
+	uint32_t shapeIndex;
+	uint32_t primIndex;
+
+	int preCompute(uint32_t si, uint32_t pi, const point3& A, const point3& B, const point3& C)
 	{
 		shapeIndex = si;
 		primIndex = pi;
 
 		static const int waldModulo[4] = { 1, 2, 0, 1 };
 
-		const point3& A = vertices[idx[0]];
-		const point3& B = vertices[idx[1]];
-		const point3& C = vertices[idx[2]];
-
 		vec3 b = C - A, c = B - A, N = cross(c, b);
 
 		k = 0;
@@ -71,7 +82,8 @@ public:
 		return 0;
 	}
 
-	virtual bool hit_fast(const ray& r, fType t_min, fType t_max) const override
+	// returns the plane distance and barycentrics, false when missed
+	inline bool intersect(const ray& r, fType t_min, fType t_max, float& t, float& u, float& v) const
 	{
 		float o_u, o_v, o_k, d_u, d_v, d_k;
 		switch (k)
@@ -105,7 +117,7 @@ public:
 		}
 
 		/* Calculate the plane intersection (Typo in the thesis?) */
-		float t = (n_d - o_u * n_u - o_v * n_v - o_k) / (d_u * n_u + d_v * n_v + d_k);
+		t = (n_d - o_u * n_u - o_v * n_v - o_k) / (d_u * n_u + d_v * n_v + d_k);
 		if (t < static_cast<float>(t_min) || t > static_cast<float>(t_max))
 			return false;
 
@@ -114,74 +126,315 @@ public:
 		const float hv = o_v + t * d_v - a_v;
 
 		/* In barycentric coordinates */
-		float u = hv * b_nu + hu * b_nv;
-		float v = hu * c_nu + hv * c_nv;
+		u = hv * b_nu + hu * b_nv;
+		v = hu * c_nu + hv * c_nv;
 
-		if (u >= 0 && v >= 0 && u + v <= 1.0f)
-			return true;
+		return u >= 0 && v >= 0 && u + v <= 1.0f;
+	}
 
-		return false;
+	inline bool hit_fast(const ray& r, fType t_min, fType t_max) const
+	{
+		float t, u, v;
+		return intersect(r, t_min, t_max, t, u, v);
 	}
 
-	virtual bool hit(const ray& r, fType t_min, fType t_max, hit_cache& cache) const override
+	inline bool hit(const ray& r, fType t_min, fType t_max, hit_cache& cache) const
 	{
-		float o_u, o_v, o_k, d_u, d_v, d_k;
-		switch (k) 
-		{
-		case 0:
-			o_u = r.origin[1];
-			o_v = r.origin[2];
-			o_k = r.origin[0];
-			d_u = r.direction[1];
-			d_v = r.direction[2];
-			d_k = r.direction[0];
-			break;
-		case 1:
-			o_u = r.origin[2];
-			o_v = r.origin[0];
-			o_k = r.origin[1];
-			d_u = r.direction[2];
-			d_v = r.direction[0];
-			d_k = r.direction[1];
-			break;
-		case 2:
-			o_u = r.origin[0];
-			o_v = r.origin[1];
-			o_k = r.origin[2];
-			d_u = r.direction[0];
-			d_v = r.direction[1];
-			d_k = r.direction[2];
-			break;
-		default:
+		float t, u, v;
+		if (!intersect(r, t_min, t_max, t, u, v))
 			return false;
+
+		cache.shapeIndex = shapeIndex;
+		cache.primIndex = primIndex;
+
+		cache.u = static_cast<fType>(u);
+		cache.v = static_cast<fType>(v);
+		cache.t = static_cast<fType>(t);
+
+		return true;
+	}
+};
+
+// number of triangles intersected at once by the leaf kernel
+#if defined(USE_AVX2)
+const int tri_block_width = 8;
+#else
+const int tri_block_width = 4;
+#endif
+
+// soa block of TriAccel records filled by the bvh leaves,
+// unused lanes have k = 3 and never report a hit
+template <int N>
+struct alignas(32) tri_accel_block
+{
+	uint32_t k[N];
+	float n_u[N];
+	float n_v[N];
+	float n_d[N];
+
+	float a_u[N];
+	float a_v[N];
+	float b_nu[N];
+	float b_nv[N];
+
+	float c_nu[N];
+	float c_nv[N];
+
+	uint32_t shapeIndex[N];
+	uint32_t primIndex[N];
+
+	void clear()
+	{
+		for (int i = 0; i < N; i++)
+		{
+			k[i] = 3;
+			n_u[i] = n_v[i] = n_d[i] = a_u[i] = a_v[i] = b_nu[i] = b_nv[i] = c_nu[i] = c_nv[i] = 0.0f;
+			shapeIndex[i] = primIndex[i] = 0;
 		}
+	}
 
-		/* Calculate the plane intersection (Typo in the thesis?) */
-		float t = (n_d - o_u * n_u - o_v * n_v - o_k) / (d_u * n_u + d_v * n_v + d_k);
-		if (t < static_cast<float>(t_min) || t > static_cast<float>(t_max))
-			return false;
+	void set(int i, const tri_accel& tri)
+	{
+		k[i] = tri.k;
+		n_u[i] = tri.n_u;
+		n_v[i] = tri.n_v;
+		n_d[i] = tri.n_d;
+		a_u[i] = tri.a_u;
+		a_v[i] = tri.a_v;
+		b_nu[i] = tri.b_nu;
+		b_nv[i] = tri.b_nv;
+		c_nu[i] = tri.c_nu;
+		c_nv[i] = tri.c_nv;
+		shapeIndex[i] = tri.shapeIndex;
+		primIndex[i] = tri.primIndex;
+	}
+};
 
-		/* Calculate the projected plane intersection point */
-		const float hu = o_u + t * d_u - a_u;
-		const float hv = o_v + t * d_v - a_v;
+using tri_block = tri_accel_block<tri_block_width>;
 
-		/* In barycentric coordinates */
-		float u = hv * b_nu + hu * b_nv;
-		float v = hu * c_nu + hv * c_nv;
+// ray origin and direction permuted to (u, v, k) for every projection axis k,
+// lane k of each table holds the component used by triangles projected along k
+struct tri_ray
+{
+	alignas(32) float o_u[8];
+	alignas(32) float o_v[8];
+	alignas(32) float o_k[8];
+	alignas(32) float d_u[8];
+	alignas(32) float d_v[8];
+	alignas(32) float d_k[8];
+
+	tri_ray() {}
+	tri_ray(const ray& r)
+	{
+		// axis k projects onto u = (k + 1) % 3 and v = (k + 2) % 3
+		const float ox = r.origin.x, oy = r.origin.y, oz = r.origin.z;
+		const float dx = r.direction.x, dy = r.direction.y, dz = r.direction.z;
+		fill(o_u, oy, oz, ox);
+		fill(o_v, oz, ox, oy);
+		fill(o_k, ox, oy, oz);
+		fill(d_u, dy, dz, dx);
+		fill(d_v, dz, dx, dy);
+		fill(d_k, dx, dy, dz);
+	}
+
+	static inline void fill(float* table, float x, float y, float z)
+	{
+		table[0] = x;
+		table[1] = y;
+		table[2] = z;
+		for (int i = 3; i < 8; i++)
+			table[i] = 0.0f;
+	}
+};
+
+// intersects all lanes of a block, returns the mask of lanes hit within [t_min, t_max]
+template <int N>
+inline int intersect_block(const tri_accel_block<N>& block, const tri_ray& r, float t_min, float t_max, float* t_out, float* u_out, float* v_out)
+{
+	int mask = 0;
+	for (int i = 0; i < N; i++)
+	{
+		uint32_t k = block.k[i];
+		if (k > 2)
+			continue;
+
+		float t = (block.n_d[i] - r.o_u[k] * block.n_u[i] - r.o_v[k] * block.n_v[i] - r.o_k[k]) / (r.d_u[k] * block.n_u[i] + r.d_v[k] * block.n_v[i] + r.d_k[k]);
+		if (!(t >= t_min && t <= t_max))
+			continue;
 
+		const float hu = r.o_u[k] + t * r.d_u[k] - block.a_u[i];
+		const float hv = r.o_v[k] + t * r.d_v[k] - block.a_v[i];
+
+		float u = hv * block.b_nu[i] + hu * block.b_nv[i];
+		float v = hu * block.c_nu[i] + hv * block.c_nv[i];
 		if (u >= 0 && v >= 0 && u + v <= 1.0f)
 		{
-			cache.shapeIndex = shapeIndex;
-			cache.primIndex = primIndex;
+			t_out[i] = t;
+			u_out[i] = u;
+			v_out[i] = v;
+			mask |= 1 << i;
+		}
+	}
 
-			cache.u = static_cast<fType>(u);
-			cache.v = static_cast<fType>(v);
-			cache.t = static_cast<fType>(t);
+	return mask;
+}
 
-			return true;
-		}
+#ifdef USE_AVX2
+template <>
+inline int intersect_block<8>(const tri_accel_block<8>& block, const tri_ray& r, float t_min, float t_max, float* t_out, float* u_out, float* v_out)
+{
+	__m256i k = _mm256_load_si256(reinterpret_cast<const __m256i*>(block.k));
+	__m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(3), k));
+
+	// gather the ray components matching each lane's projection axis
+	__m256 o_u = _mm256_permutevar8x32_ps(_mm256_load_ps(r.o_u), k);
+	__m256 o_v = _mm256_permutevar8x32_ps(_mm256_load_ps(r.o_v), k);
+	__m256 o_k = _mm256_permutevar8x32_ps(_mm256_load_ps(r.o_k), k);
+	__m256 d_u = _mm256_permutevar8x32_ps(_mm256_load_ps(r.d_u), k);
+	__m256 d_v = _mm256_permutevar8x32_ps(_mm256_load_ps(r.d_v), k);
+	__m256 d_k = _mm256_permutevar8x32_ps(_mm256_load_ps(r.d_k), k);
+
+	__m256 n_u = _mm256_load_ps(block.n_u);
+	__m256 n_v = _mm256_load_ps(block.n_v);
+
+	__m256 num = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.n_d), _mm256_mul_ps(o_u, n_u)), _mm256_mul_ps(o_v, n_v)), o_k);
+	__m256 den = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d_u, n_u), _mm256_mul_ps(d_v, n_v)), d_k);
+	__m256 t = _mm256_div_ps(num, den);
+
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LE_OQ));
+	if (_mm256_movemask_ps(valid) == 0)
+		return 0;
+
+	__m256 hu = _mm256_sub_ps(_mm256_add_ps(o_u, _mm256_mul_ps(t, d_u)), _mm256_load_ps(block.a_u));
+	__m256 hv = _mm256_sub_ps(_mm256_add_ps(o_v, _mm256_mul_ps(t, d_v)), _mm256_load_ps(block.a_v));
+
+	__m256 u = _mm256_add_ps(_mm256_mul_ps(hv, _mm256_load_ps(block.b_nu)), _mm256_mul_ps(hu, _mm256_load_ps(block.b_nv)));
+	__m256 v = _mm256_add_ps(_mm256_mul_ps(hu, _mm256_load_ps(block.c_nu)), _mm256_mul_ps(hv, _mm256_load_ps(block.c_nv)));
+
+	__m256 zero = _mm256_setzero_ps();
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+
+	int mask = _mm256_movemask_ps(valid);
+	if (mask)
+	{
+		_mm256_storeu_ps(t_out, t);
+		_mm256_storeu_ps(u_out, u);
+		_mm256_storeu_ps(v_out, v);
+	}
+
+	return mask;
+}
+#endif
+
+#ifdef USE_SSE
+// lane-wise select of the table entry picked by each lane's projection axis
+inline __m128 select_axis(const float* table, __m128 is_x, __m128 is_y, __m128 is_z)
+{
+	return _mm_or_ps(_mm_or_ps(_mm_and_ps(is_x, _mm_set1_ps(table[0])), _mm_and_ps(is_y, _mm_set1_ps(table[1]))), _mm_and_ps(is_z, _mm_set1_ps(table[2])));
+}
+
+template <>
+inline int intersect_block<4>(const tri_accel_block<4>& block, const tri_ray& r, float t_min, float t_max, float* t_out, float* u_out, float* v_out)
+{
+	__m128i k = _mm_load_si128(reinterpret_cast<const __m128i*>(block.k));
+	__m128 is_x = _mm_castsi128_ps(_mm_cmpeq_epi32(k, _mm_set1_epi32(0)));
+	__m128 is_y = _mm_castsi128_ps(_mm_cmpeq_epi32(k, _mm_set1_epi32(1)));
+	__m128 is_z = _mm_castsi128_ps(_mm_cmpeq_epi32(k, _mm_set1_epi32(2)));
+	__m128 valid = _mm_or_ps(_mm_or_ps(is_x, is_y), is_z);
+
+	__m128 o_u = select_axis(r.o_u, is_x, is_y, is_z);
+	__m128 o_v = select_axis(r.o_v, is_x, is_y, is_z);
+	__m128 o_k = select_axis(r.o_k, is_x, is_y, is_z);
+	__m128 d_u = select_axis(r.d_u, is_x, is_y, is_z);
+	__m128 d_v = select_axis(r.d_v, is_x, is_y, is_z);
+	__m128 d_k = select_axis(r.d_k, is_x, is_y, is_z);
+
+	__m128 n_u = _mm_load_ps(block.n_u);
+	__m128 n_v = _mm_load_ps(block.n_v);
+
+	__m128 num = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.n_d), _mm_mul_ps(o_u, n_u)), _mm_mul_ps(o_v, n_v)), o_k);
+	__m128 den = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d_u, n_u), _mm_mul_ps(d_v, n_v)), d_k);
+	__m128 t = _mm_div_ps(num, den);
+
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_set1_ps(t_min)));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(t, _mm_set1_ps(t_max)));
+	if (_mm_movemask_ps(valid) == 0)
+		return 0;
+
+	__m128 hu = _mm_sub_ps(_mm_add_ps(o_u, _mm_mul_ps(t, d_u)), _mm_load_ps(block.a_u));
+	__m128 hv = _mm_sub_ps(_mm_add_ps(o_v, _mm_mul_ps(t, d_v)), _mm_load_ps(block.a_v));
+
+	__m128 u = _mm_add_ps(_mm_mul_ps(hv, _mm_load_ps(block.b_nu)), _mm_mul_ps(hu, _mm_load_ps(block.b_nv)));
+	__m128 v = _mm_add_ps(_mm_mul_ps(hu, _mm_load_ps(block.c_nu)), _mm_mul_ps(hv, _mm_load_ps(block.c_nv)));
+
+	__m128 zero = _mm_setzero_ps();
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+
+	int mask = _mm_movemask_ps(valid);
+	if (mask)
+	{
+		_mm_storeu_ps(t_out, t);
+		_mm_storeu_ps(u_out, u);
+		_mm_storeu_ps(v_out, v);
+	}
 
+	return mask;
+}
+#endif
+
+// closest hit among the lanes of a block, the hit shrinks t_max
+template <int N>
+inline bool hit_block(const tri_accel_block<N>& block, const tri_ray& r, fType t_min, fType& t_max, hit_cache& cache)
+{
+	alignas(32) float t[N], u[N], v[N];
+	int mask = intersect_block<N>(block, r, static_cast<float>(t_min), static_cast<float>(t_max), t, u, v);
+	if (mask == 0)
 		return false;
+
+	int best = -1;
+	for (int i = 0; i < N; i++)
+	{
+		if ((mask & (1 << i)) && (best < 0 || t[i] < t[best]))
+			best = i;
+	}
+
+	cache.shapeIndex = block.shapeIndex[best];
+	cache.primIndex = block.primIndex[best];
+	cache.u = static_cast<fType>(u[best]);
+	cache.v = static_cast<fType>(v[best]);
+	cache.t = static_cast<fType>(t[best]);
+	t_max = cache.t;
+
+	return true;
+}
+
+template <int N>
+inline bool hit_block_fast(const tri_accel_block<N>& block, const tri_ray& r, fType t_min, fType t_max)
+{
+	alignas(32) float t[N], u[N], v[N];
+	return intersect_block<N>(block, r, static_cast<float>(t_min), static_cast<float>(t_max), t, u, v) != 0;
+}
+
+// vertex indices of a triangle, the geometry lives in its mesh
+class triangle
+{
+public:
+	aabb bounding_box(const std::vector<point3>& vertices) const
+	{
+		aabb box;
+		for (int i = 0; i < 3; i++)
+			box.extand(vertices[idx[i]]);
+		return box;
+	}
+
+	int preCompute(tri_accel& accel, uint32_t si, uint32_t pi, const std::vector<point3>& vertices) const
+	{
+		return accel.preCompute(si, pi, vertices[idx[0]], vertices[idx[1]], vertices[idx[2]]);
 	}
 
 	void fill_hit_record(const ray& r, const hit_cache& cache, hit_record& record, const std::vector<point3>& vertices, const std::vector<point3>& normals, const std::vector<point2>& texcoords) const
@@ -210,9 +463,26 @@ public:
 		const vec2& t1 = texcoords[idx1];
 		const vec2& t2 = texcoords[idx2];
 		record.uv = (1.0 - u - v) * t0 + u * t1 + v * t2;
+
+		//footprint of the ray's cone, the ellipse it leaves on the triangle is taken as the circle of
+		//the same area and scaled from world to uv units by the triangle's uv area over its area
+		record.footprint = 0.0;
+		fType width = r.cone_width_at(cache.t);
+		if (width > 0)
+		{
+			vec3 n = cross(p1 - p0, p2 - p0);
+			fType area = n.length();
+			vec2 s1 = t1 - t0, s2 = t2 - t0;
+			fType uv_area = std::abs(s1.x * s2.y - s1.y * s2.x);
+			if (area > 0)
+			{
+				fType cos_theta = std::max(std::abs(dot(r.direction, n)) / area, (fType)1e-4);
+				record.footprint = width * std::sqrt(uv_area / area / cos_theta);
+			}
+		}
 	}
 
-	fType surfaceArea(const std::vector<point3>& vertices)
+	fType surfaceArea(const std::vector<point3>& vertices) const
 	{
 		const point3& p0 = vertices[idx[0]];
 		const point3& p1 = vertices[idx[1]];
@@ -248,24 +518,7 @@ public:
 		rec.uv = t0 * (1.0 - bary.x - bary.y) + t1 * bary.x + t2 * bary.y;
 	}
 
-private:
-	//Pre-computed triangle representation based on Ingo Wald's TriAccel layout.
-	uint32_t k;
-	float n_u;
-	float n_v;
-	float n_d;
-
-	float a_u;
-	float a_v;
-	float b_nu;
-	float b_nv;
-
-	float c_nu;
-	float c_nv;
-
 public:
-	uint32_t shapeIndex;
-	uint32_t primIndex;
 	uint32_t idx[3];
 };
 
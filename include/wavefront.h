@@ -0,0 +1,349 @@
+#pragma once
+
+#include "common.h"
+#include "camera.h"
+#include "material.h"
+#include "scene.h"
+#include "scheduler.h"
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+// stream path tracer: paths live in a pool of soa buffers and advance one bounce at a time
+// through separate stages (extend, shade, shadow), each a tight loop over a queue of paths.
+// it evaluates the same estimator as ray_color in main.cpp
+class wavefront_integrator
+{
+public:
+	wavefront_integrator(Scene& s, int max_depth, int rr_depth, uint32_t pool_size, bool sort_rays = false)
+		: scene(s), max_depth(max_depth), rr_depth(rr_depth), pool_size(std::max(1u, pool_size)), sort_rays(sort_rays) {}
+
+	// accumulates samples [first_sample, first_sample + samples_per_pixel) into every pixel of region,
+	// pixels are stored row by row from the bottom and stay black outside of region
+	void render(const camera& cam, int image_width, int image_height, const render_tile& region, int first_sample, int samples_per_pixel,
+		std::vector<color>& pixels)
+	{
+		pixels.assign(image_width * image_height, color(0.0));
+
+		const uint32_t region_width = region.x1 - region.x0;
+		const uint32_t total_pixels = region_width * (region.y1 - region.y0);
+
+		const uint32_t capacity = std::min(pool_size, total_pixels);
+		allocate(capacity);
+
+		scene_bound = *scene.bounding_box();
+		extended_rays = 0;
+		extend_seconds = sort_seconds = 0.0;
+
+		// a wave holds each of its pixels once, so finished paths add to their pixel without races
+		uint64_t total_paths = (uint64_t)total_pixels * samples_per_pixel;
+		uint64_t finished_paths = 0;
+		for (int s = 0; s < samples_per_pixel; s++)
+		{
+			sample_index = first_sample + s;
+			for (uint32_t first = 0; first < total_pixels; first += capacity)
+			{
+				uint32_t count = std::min(capacity, total_pixels - first);
+				generate(cam, image_width, image_height, region, first, count);
+
+				while (!active.empty())
+				{
+					if (sort_rays && depth[active[0]] > 0)
+						sort_active();
+					extend();
+					shade();
+					trace_shadows();
+				}
+
+#pragma omp parallel for
+				for (int i = 0; i < (int)count; i++)
+					pixels[pixel[i]] += radiance[i];
+
+				finished_paths += count;
+				printf("\rrendering %.2f%%...", (100.0f * finished_paths) / total_paths);
+			}
+		}
+
+		printf("\n");
+		INFO("extended %llu rays at %.2f Mrays/s, ray sorting %s (%.2fs)", (unsigned long long)extended_rays,
+			static_cast<float>(extended_rays / extend_seconds / 1e6), sort_rays ? "on" : "off", static_cast<float>(sort_seconds));
+	}
+
+private:
+	Scene& scene;
+	int max_depth;
+	int rr_depth;
+	uint32_t pool_size;
+	bool sort_rays;
+
+	aabb scene_bound;
+	int sample_index;
+	uint64_t extended_rays;
+	double extend_seconds;
+	double sort_seconds;
+
+	// path state
+	std::vector<ray> rays;
+	std::vector<color> throughput;
+	std::vector<color> radiance;
+	std::vector<fType> bsdf_pdf;
+	std::vector<int> depth;
+	std::vector<uint32_t> pixel;
+
+	// results of the extend stage
+	std::vector<hit_record> recs;
+	std::vector<char> found;
+
+	// shadow ray of the current bounce and the radiance it carries if unoccluded
+	std::vector<ray> shadow_rays;
+	std::vector<fType> shadow_dist;
+	std::vector<uint32_t> shadow_light;
+	std::vector<color> shadow_value;
+	std::vector<char> has_shadow;
+
+	// queues of path indices
+	std::vector<uint32_t> active;
+	std::vector<uint32_t> shading;
+	std::vector<uint32_t> shadows;
+	std::vector<uint64_t> sort_keys;
+
+	void allocate(uint32_t capacity)
+	{
+		rays.resize(capacity);
+		throughput.resize(capacity);
+		radiance.resize(capacity);
+		bsdf_pdf.resize(capacity);
+		depth.resize(capacity);
+		pixel.resize(capacity);
+		recs.resize(capacity);
+		found.resize(capacity);
+		shadow_rays.resize(capacity);
+		shadow_dist.resize(capacity);
+		shadow_light.resize(capacity);
+		shadow_value.resize(capacity);
+		has_shadow.resize(capacity);
+
+		active.reserve(capacity);
+		shading.reserve(capacity);
+		shadows.reserve(capacity);
+		sort_keys.reserve(capacity);
+	}
+
+	// one camera path for each pixel [first, first + count) of region
+	void generate(const camera& cam, int image_width, int image_height, const render_tile& region, uint32_t first, uint32_t count)
+	{
+		const uint32_t region_width = region.x1 - region.x0;
+
+#pragma omp parallel for
+		for (int i = 0; i < (int)count; i++)
+		{
+			int x = region.x0 + (first + i) % region_width;
+			int y = region.y0 + (first + i) / region_width;
+			uint32_t index = y * image_width + x;
+
+			start_sample(index, sample_index);
+			fType u = (x + random_value()) / image_width;
+			fType v = (y + random_value()) / image_height;
+
+			rays[i] = cam.get_ray(u, v);
+			throughput[i] = color(1.0);
+			radiance[i] = color(0.0);
+			bsdf_pdf[i] = 0.0;
+			depth[i] = 0;
+			pixel[i] = index;
+		}
+
+		active.resize(count);
+		for (uint32_t i = 0; i < count; i++)
+			active[i] = i;
+	}
+
+	void extend()
+	{
+		auto start = std::chrono::steady_clock::now();
+
+#pragma omp parallel for
+		for (int j = 0; j < (int)active.size(); j++)
+		{
+			uint32_t i = active[j];
+			found[i] = scene.intersect(rays[i], recs[i]);
+		}
+
+		extend_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		extended_rays += active.size();
+	}
+
+	// spreads the low 9 bits of v three bits apart
+	static inline uint32_t expand_bits(uint32_t v)
+	{
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v << 8)) & 0x0300F00F;
+		v = (v | (v << 4)) & 0x030C30C3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+
+	// orders secondary rays by direction octant, then by the morton code of their origin,
+	// so rays traversed one after another touch the same nodes
+	void sort_active()
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		const vec3 extent = scene_bound.size();
+		sort_keys.resize(active.size());
+
+#pragma omp parallel for
+		for (int j = 0; j < (int)active.size(); j++)
+		{
+			uint32_t i = active[j];
+			const ray& r = rays[i];
+
+			uint32_t cell[3];
+			for (int a = 0; a < 3; a++)
+			{
+				fType t = extent[a] > 0 ? (r.origin[a] - scene_bound.minimum[a]) / extent[a] : 0.0;
+				cell[a] = static_cast<uint32_t>(clamp(t, 0.0, 1.0) * 511.0);
+			}
+
+			uint32_t octant = (r.sign[0] << 2) | (r.sign[1] << 1) | r.sign[2];
+			uint32_t key = (octant << 27) | (expand_bits(cell[0]) << 2) | (expand_bits(cell[1]) << 1) | expand_bits(cell[2]);
+			sort_keys[j] = ((uint64_t)key << 32) | i;
+		}
+
+		std::sort(sort_keys.begin(), sort_keys.end());
+		for (size_t j = 0; j < sort_keys.size(); j++)
+			active[j] = static_cast<uint32_t>(sort_keys[j]);
+
+		sort_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void shade()
+	{
+		// misses and emitters end their paths, everything else is shaded
+		shading.clear();
+		for (uint32_t i : active)
+		{
+			if (!found[i])
+			{
+				radiance[i] += throughput[i] * scene.background;
+				continue;
+			}
+
+			if (recs[i].hit_light)
+			{
+				const hit_record& rec = recs[i];
+				if (!rec.front_face)
+					continue;
+
+				//first bounce or delta distribution
+				if (depth[i] == 0 || bsdf_pdf[i] < 1e-6)
+					radiance[i] += throughput[i] * rec.mat_ptr->emitted(rec);
+				else
+				{
+					fType light_dir_pdf = scene.pdfLightDirect(rec, rays[i].direction);
+					fType weight = mix_weight(bsdf_pdf[i], light_dir_pdf);
+					radiance[i] += throughput[i] * weight * rec.mat_ptr->emitted(rec);
+				}
+				continue;
+			}
+
+			shading.push_back(i);
+		}
+
+		// paths hitting the same material are shaded together
+		std::sort(shading.begin(), shading.end(), [this](uint32_t a, uint32_t b)
+			{
+				return recs[a].mat_ptr < recs[b].mat_ptr;
+			});
+
+#pragma omp parallel for
+		for (int j = 0; j < (int)shading.size(); j++)
+		{
+			uint32_t i = shading[j];
+			const hit_record& rec = recs[i];
+			const material* bsdf = rec.mat_ptr;
+
+			// a path may be shaded on a different thread every bounce, so it picks up its sample again
+			start_sample(pixel[i], sample_index);
+			start_vertex(depth[i]);
+
+			//sample direct illumination, the shadow ray is traced in the next stage
+			has_shadow[i] = false;
+
+			vec3 light_dir;
+			fType pick_pdf, light_pdf;
+			size_t light = scene.pickLight(pick_pdf);
+			color directVal = scene.sampleLight(light, pick_pdf, rec.p, rec.normal, light_dir, light_pdf, shadow_dist[i]);
+			if (!directVal.near_zero())
+			{
+				onb shadingFrame(rec.normal);
+				vec3 wi = shadingFrame.local(-rays[i].direction);
+				vec3 wo = shadingFrame.local(light_dir);
+
+				color bsdfVal = bsdf->eval(rec, wi, wo);
+				if (!bsdfVal.near_zero())
+				{
+					fType bsdfPdf = bsdf->pdf(rec, wi, wo);
+					fType weight = mix_weight(light_pdf, bsdfPdf);
+
+					shadow_rays[i] = ray(rec.p, light_dir);
+					shadow_light[i] = static_cast<uint32_t>(light);
+					shadow_value[i] = throughput[i] * weight * directVal * bsdfVal;
+					has_shadow[i] = true;
+				}
+			}
+
+			//sample indirect illumination
+			scatter_record srec;
+			if (!bsdf->scatter(rays[i].direction, rec, srec) || srec.pdf_value < 1e-6)
+			{
+				// ends the path
+				depth[i] = max_depth;
+				continue;
+			}
+
+			// Russian roulette
+			fType rr_weight = 1.0;
+			if (depth[i] >= rr_depth)
+			{
+				fType rr = 0.618;
+				if (random_value() > rr)
+				{
+					depth[i] = max_depth;
+					continue;
+				}
+
+				rr_weight = 1.0 / rr;
+			}
+
+			srec.scatter_ray.continue_cone(rays[i], rec.t);
+			rays[i] = srec.scatter_ray;
+			bsdf_pdf[i] = srec.delta_distributed ? 0.0 : srec.pdf_value;
+			throughput[i] *= (rr_weight * srec.attenuation);
+			depth[i] += 1;
+		}
+
+		// surviving paths are extended by the next wave
+		active.clear();
+		shadows.clear();
+		for (uint32_t i : shading)
+		{
+			if (has_shadow[i])
+				shadows.push_back(i);
+			if (depth[i] < max_depth)
+				active.push_back(i);
+		}
+	}
+
+	void trace_shadows()
+	{
+#pragma omp parallel for
+		for (int j = 0; j < (int)shadows.size(); j++)
+		{
+			uint32_t i = shadows[j];
+			if (!scene.occluded(shadow_rays[i], shadow_dist[i], shadow_light[i]))
+				radiance[i] += shadow_value[i];
+		}
+	}
+};
@@ -14,6 +14,10 @@
 #include "bvh.h"
 #include "model.h"
 #include "scene.h"
+#include "wavefront.h"
+#include "scheduler.h"
+#include "shard.h"
+#include "scene_cache.h"
 
 #define TINYEXR_IMPLEMENTATION
 #include "tinyexr.h"
@@ -24,6 +28,14 @@
 #include <fstream>
 #include <time.h>
 #include <omp.h>
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <sstream>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 std::string model_name = "staircase";
 std::string resource_dir = "../resource";
@@ -34,7 +46,76 @@ int max_depth = 10;
 int rr_depth = 3;
 bool gamma_correct = false;
 
-color ray_color(ray& r_origin, Scene& scene)
+bvh_build_config bvh_config;
+tile_scheduler_config tile_config;
+
+// camera rays traced together, 0 traces them one by one
+int packet_size = 0;
+bool bench_rays = false;
+// time the scalar path tracer with 1, 2, 4... threads
+bool bench_threads = false;
+// time the random number generators
+bool bench_rng = false;
+
+// render in passes and stop pixels whose relative error is below adaptive_threshold, 0 renders
+// samples_per_pixel everywhere. the budget stays samples_per_pixel per pixel on average, no pixel
+// takes more than adaptive_max_spp (0 means 4x samples_per_pixel)
+fType adaptive_threshold = 0.0;
+int adaptive_max_spp = 0;
+// also write the sample count of every pixel to <output>_samples.exr
+bool sample_aov = false;
+// keep adding passes over the image until this many seconds after startup instead of taking a
+// fixed sample count, 0 renders samples_per_pixel
+double time_budget = 0.0;
+std::chrono::steady_clock::time_point program_start;
+// write the progressive render's buffers to <output>.ckpt every checkpoint_interval seconds, 0 never
+double checkpoint_interval = 0.0;
+// continue from <output>.ckpt instead of starting over
+bool resume = false;
+
+// render a shard of the frame for -merge: the pixels [x0, x1) x [y0, y1) of shard_region, rows counted
+// from the top of the image, and the samples [first_sample, end_sample) which replace -s
+bool shard = false;
+render_tile shard_region{ 0, 0, 0, 0 };
+int first_sample = 0;
+int end_sample = 0;
+// combine the shards in merge_inputs into merge_output instead of rendering, -g applies to the merge
+std::string merge_output;
+std::vector<std::string> merge_inputs;
+
+// load the scene once and render the jobs read from stdin one after another, see run_server
+bool server = false;
+
+// load the welded meshes and the bvh from <model>.rgcache beside the obj when it is up to date,
+// -buildcache writes it and exits
+bool use_cache = true;
+bool build_cache = false;
+
+// parse the obj with tinyobj on one thread instead of load_obj_parallel
+bool serial_obj = false;
+
+// camera rays carry the spread of a pixel and textures are filtered from the mip levels it covers,
+// -nomip looks every texture up at full resolution
+bool mipmapping = true;
+
+// stream paths through the wavefront integrator instead of ray_color, pool_size paths at a time
+bool wavefront = false;
+uint32_t pool_size = 1 << 12;
+// sort the secondary rays of every wave for coherent traversal
+bool sort_rays = false;
+
+// first hit and direct light sample of a path, traced ahead of time by a ray packet
+struct primary_record
+{
+	bool hit = false;
+	hit_record rec;
+
+	color direct;
+	vec3 light_dir;
+	fType light_pdf = 0.0;
+};
+
+color ray_color(ray& r_origin, Scene& scene, const primary_record* primary = nullptr)
 {
     ray r = r_origin;
     int depth = 0;
@@ -45,13 +126,24 @@ color ray_color(ray& r_origin, Scene& scene)
     hit_record rec;
     while (depth < max_depth)
     {
-        if (!scene.intersect(r, rec))
+        start_vertex(depth);
+
+        bool found;
+        if (depth == 0 && primary)
+        {
+            found = primary->hit;
+            rec = primary->rec;
+        }
+        else
+            found = scene.intersect(r, rec);
+
+        if (!found)
         {
             ret += throughput * scene.background;
             break;
         }
 
-		auto bsdf = rec.mat_ptr;
+		const material* bsdf = rec.mat_ptr;
 
         //check hit light
         if (rec.hit_light)
@@ -77,7 +169,15 @@ color ray_color(ray& r_origin, Scene& scene)
 		//sample direct illumination
 		vec3 light_dir;
 		fType light_pdf;
-		color directVal = scene.sampleLights(rec.p, rec.normal, light_dir, light_pdf);
+		color directVal;
+		if (depth == 0 && primary)
+		{
+			directVal = primary->direct;
+			light_dir = primary->light_dir;
+			light_pdf = primary->light_pdf;
+		}
+		else
+			directVal = scene.sampleLights(rec.p, rec.normal, light_dir, light_pdf);
 		if (!directVal.near_zero())
 		{
 			onb shadingFrame(rec.normal);
@@ -112,6 +212,7 @@ color ray_color(ray& r_origin, Scene& scene)
 			rr_weight = 1.0 / rr;
 		}
 
+        srec.scatter_ray.continue_cone(r, rec.t);
         r = srec.scatter_ray;
         bsdf_pdf = srec.delta_distributed ? 0.0 : srec.pdf_value;
         throughput *= (rr_weight * srec.attenuation);
@@ -122,6 +223,935 @@ color ray_color(ray& r_origin, Scene& scene)
     return ret;
 }
 
+// random streams of one packet sample, whose parts are drawn lane by lane in separate loops
+enum packet_stream : uint32_t
+{
+	camera_stream,
+	light_pick_stream,
+	light_stream,
+	path_stream
+};
+
+// traces the camera rays of a pixel tile as one packet, followed by their first shadow rays
+// toward an emitter shared by the whole packet. the rest of every path is traced alone.
+// pixels and sample pick the random streams of the lanes
+template <int N>
+void trace_packet(ray* rays, int count, Scene& scene, color* colors, const uint32_t* pixels, int sample)
+{
+	hit_record recs[N];
+	bool hits[N];
+	scene.intersect_packet<N>(rays, count, recs, hits);
+
+	primary_record primary[N];
+	ray shadow_rays[N];
+	fType shadow_dist[N];
+	int shadow_lane[N];
+	int shadow_count = 0;
+
+	size_t light = 0;
+	fType light_pdf = 0.0;
+	bool light_picked = false;
+	for (int i = 0; i < count; i++)
+	{
+		primary[i].hit = hits[i];
+		if (!hits[i])
+			continue;
+
+		primary[i].rec = recs[i];
+		if (recs[i].hit_light)
+			continue;
+
+		if (!light_picked)
+		{
+			random_seed(sample_seed(pixels[0], sample, light_pick_stream));
+			light = scene.pickLight(light_pdf);
+			light_picked = true;
+		}
+
+		random_seed(sample_seed(pixels[i], sample, light_stream));
+		primary[i].direct = scene.sampleLight(light, light_pdf, recs[i].p, recs[i].normal,
+			primary[i].light_dir, primary[i].light_pdf, shadow_dist[shadow_count]);
+		if (!primary[i].direct.near_zero())
+		{
+			shadow_rays[shadow_count] = ray(recs[i].p, primary[i].light_dir);
+			shadow_lane[shadow_count++] = i;
+		}
+	}
+
+	if (shadow_count > 0)
+	{
+		bool occluded[N];
+		scene.intersect_fast_packet<N>(shadow_rays, shadow_count, shadow_dist, occluded);
+		for (int j = 0; j < shadow_count; j++)
+		{
+			if (occluded[j])
+				primary[shadow_lane[j]].direct = color(0.0);
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		random_seed(sample_seed(pixels[i], sample, path_stream));
+		colors[i] = ray_color(rays[i], scene, &primary[i]);
+	}
+}
+
+// pixels covered by one packet: 2x2 for 4 rays, 4x2 for 8 and 4x4 for 16
+template <int N>
+struct packet_tile
+{
+	static const int width = N == 4 ? 2 : 4;
+	static const int height = N / width;
+};
+
+// pixels of the tile at (tx, ty) clipped to [0, x_end) x [0, y_end)
+template <int N>
+int gather_tile(int tx, int ty, int x_end, int y_end, int* px, int* py)
+{
+	int count = 0;
+	for (int y = ty; y < ty + packet_tile<N>::height && y < y_end; y++)
+	{
+		for (int x = tx; x < tx + packet_tile<N>::width && x < x_end; x++)
+		{
+			px[count] = x;
+			py[count] = y;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+void write_pixel(float* output, int x, int y, int image_width, int image_height, const color& pixel_color, int samples = samples_per_pixel)
+{
+	fType sample_scale = 1.0 / samples;
+	fType r = sample_scale * pixel_color.r;
+	fType g = sample_scale * pixel_color.g;
+	fType b = sample_scale * pixel_color.b;
+
+	// Divide the color by the number of samples and gamma-correct for gamma = 2.2
+	if (gamma_correct)
+	{
+		fType gamma = 1.0 / 2.2;
+		r = std::pow(r, gamma);
+		g = std::pow(g, gamma);
+		b = std::pow(b, gamma);
+	}
+
+	int flip_y = image_height - 1 - y;
+	int index = 3 * (flip_y * image_width + x);
+
+	output[index + 0] = static_cast<float>(r);
+	output[index + 1] = static_cast<float>(g);
+	output[index + 2] = static_cast<float>(b);
+}
+
+void render_scalar(Scene& scene, const camera& cam, int image_width, int image_height, const render_tile& region, float* output)
+{
+	tile_scheduler scheduler(tile_config);
+	scheduler.run(region, [&](const render_tile& tile)
+		{
+			for (int y = tile.y0; y < tile.y1; y++)
+			{
+				for (int x = tile.x0; x < tile.x1; x++)
+				{
+					color pixel_color(0, 0, 0);
+					for (int s = first_sample; s < first_sample + samples_per_pixel; s++)
+					{
+						start_sample(y * image_width + x, s);
+						fType u = (x + random_value()) / image_width;
+						fType v = (y + random_value()) / image_height;
+
+						ray r = cam.get_ray(u, v);
+						pixel_color += ray_color(r, scene);
+					}
+
+					write_pixel(output, x, y, image_width, image_height, pixel_color);
+				}
+			}
+		});
+}
+
+// running estimate of one pixel, the error test works on luminance
+struct pixel_estimate
+{
+	color sum;
+	double lum_sum = 0.0;
+	double lum_sq_sum = 0.0;
+	int samples = 0;
+	bool converged = false;
+
+	// squared standard error of the mean
+	double mean_variance() const
+	{
+		if (samples < 2)
+			return 0.0;
+		double mean = lum_sum / samples;
+		double variance = std::max(0.0, (lum_sq_sum - samples * mean * mean) / (samples - 1));
+		return variance / samples;
+	}
+};
+
+// everything a progressive render needs to carry on after the pass it was written at, the
+// random state is implied by the sample counts since every sample seeds its own stream
+struct checkpoint_header
+{
+	char magic[4];
+	uint32_t estimate_size;
+	int32_t image_width, image_height;
+	int32_t samples_per_pixel;
+	int32_t region[4];
+	int32_t first_sample;
+	float adaptive_threshold;
+	// the sampler decides the points of every sample index, another one cannot continue the estimates
+	int32_t sampler;
+	int32_t next_pass;
+	int32_t next_spp;
+};
+
+bool save_checkpoint(const std::string& path, const checkpoint_header& header, const std::vector<pixel_estimate>& estimates)
+{
+	// written aside and moved over the old one, so preemption while writing keeps the last checkpoint
+	std::string temp_path = path + ".tmp";
+	FILE* file = fopen(temp_path.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(estimates.data(), sizeof(pixel_estimate), estimates.size(), file) == estimates.size();
+	ok = fclose(file) == 0 && ok;
+
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(temp_path, path, ec);
+	return ok && !ec;
+}
+
+bool load_checkpoint(const std::string& path, checkpoint_header& header, std::vector<pixel_estimate>& estimates)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+
+	checkpoint_header stored;
+	bool ok = fread(&stored, sizeof(stored), 1, file) == 1
+		&& memcmp(stored.magic, header.magic, 4) == 0
+		&& stored.estimate_size == header.estimate_size
+		&& stored.image_width == header.image_width
+		&& stored.image_height == header.image_height
+		&& stored.samples_per_pixel == header.samples_per_pixel
+		&& memcmp(stored.region, header.region, sizeof(header.region)) == 0
+		&& stored.first_sample == header.first_sample
+		&& stored.adaptive_threshold == header.adaptive_threshold
+		&& stored.sampler == header.sampler;
+	ok = ok && fread(estimates.data(), sizeof(pixel_estimate), estimates.size(), file) == estimates.size();
+	fclose(file);
+
+	if (ok)
+		header = stored;
+	return ok;
+}
+
+// renders the image in passes, each pass adds samples to every pixel that is still running, so the
+// image is a complete estimate after every pass. pixels are divided by their own sample count.
+// stops when the sample budget is spent or, with a time budget, at the deadline, tiles
+// started after it are skipped and their pixels keep the samples of the previous passes
+void render_progressive(Scene& scene, const camera& cam, int image_width, int image_height, const render_tile& region, float* output,
+	std::vector<int>& sample_counts, const std::string& checkpoint_path)
+{
+	const int total_pixels = image_width * image_height;
+	const int region_pixels = (region.x1 - region.x0) * (region.y1 - region.y0);
+	const bool timed = time_budget > 0;
+	const bool adaptive = adaptive_threshold > 0;
+
+	// every pixel takes a quarter of its budget, at most 16 samples, before it may stop
+	const int min_spp = adaptive ? clamp(samples_per_pixel / 4, std::min(2, samples_per_pixel), 16) : 1;
+	const int pass_spp = adaptive ? clamp(samples_per_pixel / 8, 1, 8) : 1;
+	const int max_spp = adaptive_max_spp > 0 ? adaptive_max_spp : (timed ? std::numeric_limits<int>::max() : 4 * samples_per_pixel);
+	const uint64_t budget = timed ? std::numeric_limits<uint64_t>::max() : (uint64_t)samples_per_pixel * region_pixels;
+
+	const auto start = std::chrono::steady_clock::now();
+	const auto deadline = program_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_budget));
+
+	// pixels outside of region are done before they start
+	std::vector<pixel_estimate> estimates(total_pixels);
+	for (int y = 0; y < image_height; y++)
+	{
+		for (int x = 0; x < image_width; x++)
+			estimates[y * image_width + x].converged = x < region.x0 || x >= region.x1 || y < region.y0 || y >= region.y1;
+	}
+
+	tile_scheduler_config config = tile_config;
+	config.report_progress = false;
+	tile_scheduler scheduler(config);
+
+	uint64_t spent = 0;
+	int active = region_pixels;
+	// a timed render cannot skip tiles of the first pass, so it is kept to one sample
+	int spp = timed ? 1 : min_spp;
+	int passes = 0;
+	bool expired = false;
+
+	// the magic changed when the sampler was added, older checkpoints are not read as this layout
+	checkpoint_header checkpoint{ { 'R', 'G', 'C', '2' }, sizeof(pixel_estimate), image_width, image_height, samples_per_pixel,
+		{ region.x0, region.y0, region.x1, region.y1 }, first_sample, static_cast<float>(adaptive_threshold),
+		static_cast<int32_t>(default_sampler), 0, spp };
+	if (resume)
+	{
+		if (load_checkpoint(checkpoint_path, checkpoint, estimates))
+		{
+			spp = checkpoint.next_spp;
+			active = 0;
+			for (const pixel_estimate& e : estimates)
+			{
+				spent += e.samples;
+				active += e.converged ? 0 : 1;
+			}
+			INFO("resuming from %s at pass %d, %.1f spp", checkpoint_path.c_str(), checkpoint.next_pass, static_cast<float>(spent) / region_pixels);
+		}
+		else
+			WARN("no usable checkpoint at %s for this image, starting over.", checkpoint_path.c_str());
+	}
+	auto last_checkpoint = std::chrono::steady_clock::now();
+
+	for (int pass = checkpoint.next_pass; active > 0 && !expired && spp > 0; pass++)
+	{
+		// pixels stop a whole scheduler tile at a time, a single pixel's variance is too noisy
+		// to trust after a few samples and stopping on it darkens the pixels that missed the lights
+		scheduler.run(region, [&](const render_tile& tile)
+			{
+				if (estimates[tile.y0 * image_width + tile.x0].converged)
+					return;
+				// the first pass always completes so that every pixel has a sample
+				if (timed && pass > 0 && std::chrono::steady_clock::now() >= deadline)
+					return;
+
+				double lum_sum = 0.0;
+				double error_sum = 0.0;
+				int samples = 0;
+				for (int y = tile.y0; y < tile.y1; y++)
+				{
+					for (int x = tile.x0; x < tile.x1; x++)
+					{
+						pixel_estimate& e = estimates[y * image_width + x];
+						int count = std::min(spp, max_spp - e.samples);
+						for (int s = 0; s < count; s++)
+						{
+							start_sample(y * image_width + x, first_sample + e.samples + s);
+							fType u = (x + random_value()) / image_width;
+							fType v = (y + random_value()) / image_height;
+
+							ray r = cam.get_ray(u, v);
+							color c = ray_color(r, scene);
+							double lum = c.getLuminance();
+
+							e.sum += c;
+							e.lum_sum += lum;
+							e.lum_sq_sum += lum * lum;
+						}
+						e.samples += count;
+
+						lum_sum += e.lum_sum / e.samples;
+						error_sum += e.mean_variance();
+						samples = e.samples;
+					}
+				}
+
+				// rms standard error of the tile's pixels relative to the tile's mean
+				int pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+				double error = std::sqrt(error_sum / pixels) / std::max(lum_sum / pixels, 1e-3);
+				bool converged = samples >= max_spp || (adaptive && samples >= min_spp && error < adaptive_threshold);
+
+				for (int y = tile.y0; y < tile.y1; y++)
+				{
+					for (int x = tile.x0; x < tile.x1; x++)
+						estimates[y * image_width + x].converged = converged;
+				}
+			});
+
+		passes++;
+		spent = 0;
+		active = 0;
+		for (const pixel_estimate& e : estimates)
+		{
+			spent += e.samples;
+			active += e.converged ? 0 : 1;
+		}
+
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - program_start).count();
+		expired = timed && elapsed >= time_budget;
+		if (timed)
+			printf("\rrendering pass %d, %.1f spp, %.1fs of %.1fs...", pass, static_cast<float>(spent) / region_pixels, elapsed, time_budget);
+		else
+			printf("\rrendering pass %d, %.2f%% of the budget, %.2f%% pixels converged...", pass,
+				std::min(100.0f, (100.0f * spent) / budget), (100.0f * (region_pixels - active)) / region_pixels);
+		fflush(stdout);
+
+		// the rest of the budget is split over the pixels that are still noisy, until it cannot
+		// give each of them one more sample
+		if (active > 0)
+			spp = static_cast<int>(std::min<uint64_t>((budget - std::min(spent, budget)) / active, pass_spp));
+
+		if (checkpoint_interval > 0 && active > 0 && spp > 0 && !expired
+			&& std::chrono::duration<double>(std::chrono::steady_clock::now() - last_checkpoint).count() >= checkpoint_interval)
+		{
+			checkpoint.next_pass = pass + 1;
+			checkpoint.next_spp = spp;
+			if (!save_checkpoint(checkpoint_path, checkpoint, estimates))
+				WARN("failed to write checkpoint %s.", checkpoint_path.c_str());
+			last_checkpoint = std::chrono::steady_clock::now();
+		}
+	}
+	printf("\n");
+
+	sample_counts.resize(total_pixels);
+	int min_samples = std::numeric_limits<int>::max();
+	int max_samples = 0;
+	for (int y = 0; y < image_height; y++)
+	{
+		for (int x = 0; x < image_width; x++)
+		{
+			const pixel_estimate& e = estimates[y * image_width + x];
+			if (e.samples > 0)
+				write_pixel(output, x, y, image_width, image_height, e.sum, e.samples);
+			sample_counts[(image_height - 1 - y) * image_width + x] = e.samples;
+			if (x >= region.x0 && x < region.x1 && y >= region.y0 && y < region.y1)
+			{
+				min_samples = std::min(min_samples, e.samples);
+				max_samples = std::max(max_samples, e.samples);
+			}
+		}
+	}
+
+	INFO("%d passes in %.2fs, %.1f spp on average (%d to %d)", passes,
+		static_cast<float>(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()),
+		static_cast<float>(spent) / region_pixels, min_samples, max_samples);
+	if (adaptive)
+		INFO("adaptive sampling: %.2f%% pixels stopped below %.4f relative error",
+			(100.0f * (region_pixels - active)) / region_pixels, static_cast<float>(adaptive_threshold));
+}
+
+template <int N>
+void render_packets(Scene& scene, const camera& cam, int image_width, int image_height, const render_tile& region, float* output)
+{
+	tile_scheduler scheduler(tile_config);
+	scheduler.run(region, [&](const render_tile& tile)
+		{
+			for (int ty = tile.y0; ty < tile.y1; ty += packet_tile<N>::height)
+			{
+				for (int tx = tile.x0; tx < tile.x1; tx += packet_tile<N>::width)
+				{
+					int px[N], py[N];
+					int count = gather_tile<N>(tx, ty, tile.x1, tile.y1, px, py);
+
+					uint32_t pixels[N];
+					for (int i = 0; i < count; i++)
+						pixels[i] = py[i] * image_width + px[i];
+
+					ray rays[N];
+					color colors[N];
+					color pixel_colors[N];
+					for (int s = first_sample; s < first_sample + samples_per_pixel; s++)
+					{
+						for (int i = 0; i < count; i++)
+						{
+							random_seed(sample_seed(pixels[i], s, camera_stream));
+							fType u = (px[i] + random_value()) / image_width;
+							fType v = (py[i] + random_value()) / image_height;
+							rays[i] = cam.get_ray(u, v);
+						}
+
+						trace_packet<N>(rays, count, scene, colors, pixels, s);
+						for (int i = 0; i < count; i++)
+							pixel_colors[i] += colors[i];
+					}
+
+					for (int i = 0; i < count; i++)
+						write_pixel(output, px[i], py[i], image_width, image_height, pixel_colors[i]);
+				}
+			}
+		});
+}
+
+// primary ray throughput of one ray at a time against packets, the packets must find the same hits
+template <int N>
+void benchmark_packets(Scene& scene, const std::vector<ray>& rays, const std::vector<fType>& scalar_t, int image_width, int image_height, int passes, double scalar_seconds)
+{
+	int mismatches = 0;
+	double best = 0.0;
+	for (int pass = 0; pass < passes; pass++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (int ty = 0; ty < image_height; ty += packet_tile<N>::height)
+		{
+			for (int tx = 0; tx < image_width; tx += packet_tile<N>::width)
+			{
+				int px[N], py[N];
+				int count = gather_tile<N>(tx, ty, image_width, image_height, px, py);
+
+				ray packet[N];
+				for (int i = 0; i < count; i++)
+					packet[i] = rays[py[i] * image_width + px[i]];
+
+				hit_record recs[N];
+				bool hits[N];
+				scene.intersect_packet<N>(packet, count, recs, hits);
+
+				if (pass == 0)
+				{
+					for (int i = 0; i < count; i++)
+					{
+						if ((hits[i] ? recs[i].t : -1.0) != scalar_t[py[i] * image_width + px[i]])
+							mismatches++;
+					}
+				}
+			}
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = pass == 0 ? seconds : std::min(best, seconds);
+	}
+
+	printf("packet of %2d: %.2f Mrays/s (%.2fx scalar), %d mismatches\n", N,
+		rays.size() / best / 1e6, scalar_seconds / best, mismatches);
+}
+
+void benchmark_primary_rays(Scene& scene, const camera& cam, int image_width, int image_height)
+{
+	// one jittered camera ray per pixel, traced single threaded
+	std::vector<float> jitter(2 * image_width * image_height);
+	xoshiro128p_x8 rng;
+	rng.fill(jitter.data(), jitter.size());
+
+	std::vector<ray> rays;
+	rays.reserve(image_width * image_height);
+	for (int y = 0; y < image_height; y++)
+	{
+		for (int x = 0; x < image_width; x++)
+		{
+			const float* j = &jitter[2 * rays.size()];
+			rays.push_back(cam.get_ray((x + j[0]) / image_width, (y + j[1]) / image_height));
+		}
+	}
+
+	const int passes = 5;
+	std::vector<fType> scalar_t(rays.size());
+	double best = 0.0;
+	for (int pass = 0; pass < passes; pass++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < rays.size(); i++)
+		{
+			hit_record rec;
+			scalar_t[i] = scene.intersect(rays[i], rec) ? rec.t : -1.0;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = pass == 0 ? seconds : std::min(best, seconds);
+	}
+
+	printf("primary rays, %dx%d, best of %d passes\n", image_width, image_height, passes);
+	printf("scalar:       %.2f Mrays/s\n", rays.size() / best / 1e6);
+	benchmark_packets<4>(scene, rays, scalar_t, image_width, image_height, passes, best);
+	benchmark_packets<8>(scene, rays, scalar_t, image_width, image_height, passes, best);
+	benchmark_packets<16>(scene, rays, scalar_t, image_width, image_height, passes, best);
+}
+
+// ns per uniform float of the old standard library engines against xoshiro128+, one at a time and in batches
+void benchmark_rng()
+{
+	const size_t count = 1 << 24;
+	const int passes = 5;
+	std::vector<float> values(count);
+
+	auto measure = [&](const char* name, auto&& generate)
+	{
+		double best = 0.0;
+		for (int pass = 0; pass < passes; pass++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			generate(values.data(), count);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			best = pass == 0 ? seconds : std::min(best, seconds);
+		}
+
+		double mean = 0.0;
+		for (float v : values)
+			mean += v;
+		printf("%-34s %6.3f ns/value, %7.1f M values/s, mean %.5f\n", name, best * 1e9 / count, count / best / 1e6, mean / count);
+	};
+
+	printf("%zu uniform floats in [0, 1), best of %d passes\n", count, passes);
+
+	std::default_random_engine default_engine;
+	std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+	measure("default_random_engine + uniform", [&](float* out, size_t n) { for (size_t i = 0; i < n; i++) out[i] = distribution(default_engine); });
+
+	std::minstd_rand minstd;
+	measure("minstd_rand + uniform", [&](float* out, size_t n) { for (size_t i = 0; i < n; i++) out[i] = distribution(minstd); });
+
+	xoshiro128p xoshiro(1);
+	measure("xoshiro128+", [&](float* out, size_t n) { for (size_t i = 0; i < n; i++) out[i] = xoshiro.next_float(); });
+
+	measure("random_value()", [&](float* out, size_t n) { for (size_t i = 0; i < n; i++) out[i] = static_cast<float>(random_value()); });
+
+	xoshiro128p_x8 batch(1);
+	measure("xoshiro128+ x8 batch", [&](float* out, size_t n) { batch.fill(out, n); });
+
+	// what every sample pays before its first draw, and one vertex worth of dimensions of each sampler
+	const char* names[] = { "independent sample, 8 draws", "sobol sample, 8 draws", "pmj02 sample, 8 draws" };
+	const sampler_type types[] = { sampler_type::independent, sampler_type::sobol, sampler_type::pmj02 };
+	for (int t = 0; t < 3; t++)
+	{
+		measure(names[t], [&](float* out, size_t n)
+			{
+				for (size_t i = 0; i < n; i += 8)
+				{
+					thread_sampler().start_sample(types[t], 0, static_cast<uint32_t>(i / 8), sample_seed(0, static_cast<uint32_t>(i / 8)));
+					start_vertex(0);
+					for (size_t j = 0; j < 8; j++)
+						out[i + j] = static_cast<float>(random_value());
+				}
+			});
+	}
+}
+
+// paths per second of ray_color at growing thread counts, samples_per_pixel paths per pixel
+void benchmark_threads(Scene& scene, const camera& cam, int image_width, int image_height)
+{
+	int max_threads = omp_get_max_threads();
+	std::vector<int> thread_counts;
+	for (int t = 1; t < max_threads; t *= 2)
+		thread_counts.push_back(t);
+	thread_counts.push_back(max_threads);
+
+	const int passes = 3;
+	const double paths = (double)image_width * image_height * samples_per_pixel;
+	printf("thread scaling, %dx%d, %d spp, best of %d passes, %d hardware threads\n",
+		image_width, image_height, samples_per_pixel, passes, omp_get_num_procs());
+
+	double single = 0.0;
+	for (int threads : thread_counts)
+	{
+		double best = 0.0;
+		fType sum = 0.0;
+		for (int pass = 0; pass < passes; pass++)
+		{
+			auto start = std::chrono::steady_clock::now();
+#pragma omp parallel for num_threads(threads) schedule(dynamic) reduction(+:sum)
+			for (int y = 0; y < image_height; y++)
+			{
+				for (int x = 0; x < image_width; x++)
+				{
+					for (int s = 0; s < samples_per_pixel; s++)
+					{
+						start_sample(y * image_width + x, s);
+						fType u = (x + random_value()) / image_width;
+						fType v = (y + random_value()) / image_height;
+						ray r = cam.get_ray(u, v);
+						sum += ray_color(r, scene).length();
+					}
+				}
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			best = pass == 0 ? seconds : std::min(best, seconds);
+		}
+
+		if (threads == 1)
+			single = best;
+		printf("%3d threads: %.3f Mpaths/s, %.2fx speedup, %.0f%% efficiency (mean %.4f)\n", threads,
+			paths / best / 1e6, single / best, 100.0 * single / best / threads, sum / (paths * passes));
+	}
+}
+
+// renders one frame of scene with the renderer picked on the command line and writes it to output_file
+int render_frame(Scene& scene, const camera& cam, int image_width, int image_height, const render_tile& region, const std::string& output_file)
+{
+	const bool progressive = adaptive_threshold > 0 || time_budget > 0 || checkpoint_interval > 0 || resume;
+	int output_size = image_width * image_height * 3;
+	float* output = new float[output_size]();
+
+	std::vector<int> sample_counts;
+	std::string checkpoint_file = output_file + ".ckpt";
+	scene.reset_occluder_stats();
+	if (progressive)
+		render_progressive(scene, cam, image_width, image_height, region, output, sample_counts, checkpoint_file);
+	else if (wavefront)
+	{
+		std::vector<color> pixels;
+		wavefront_integrator integrator(scene, max_depth, rr_depth, pool_size, sort_rays);
+		integrator.render(cam, image_width, image_height, region, first_sample, samples_per_pixel, pixels);
+
+		for (int y = 0; y < image_height; y++)
+		{
+			for (int x = 0; x < image_width; x++)
+				write_pixel(output, x, y, image_width, image_height, pixels[y * image_width + x]);
+		}
+	}
+	else if (packet_size == 4)
+		render_packets<4>(scene, cam, image_width, image_height, region, output);
+	else if (packet_size == 8)
+		render_packets<8>(scene, cam, image_width, image_height, region, output);
+	else if (packet_size == 16)
+		render_packets<16>(scene, cam, image_width, image_height, region, output);
+	else
+		render_scalar(scene, cam, image_width, image_height, region, output);
+
+	scene.print_occluder_stats();
+
+	// every renderer but the progressive one takes samples_per_pixel in the region
+	if (sample_counts.empty() && (shard || sample_aov))
+	{
+		sample_counts.assign(image_width * image_height, 0);
+		for (int y = region.y0; y < region.y1; y++)
+		{
+			for (int x = region.x0; x < region.x1; x++)
+				sample_counts[(image_height - 1 - y) * image_width + x] = samples_per_pixel;
+		}
+	}
+
+	const char* err;
+	int ret;
+	if (shard)
+		ret = save_shard(output_file, output, sample_counts, image_width, image_height, first_sample, &err);
+	else
+		ret = SaveEXR(output, image_width, image_height, 3, false, output_file.c_str(), &err);
+	std::cerr << "\nwriting to " << output_file << ", ret = " << ret;
+	if (ret < 0)
+		std::cerr << ", error info: " << err;
+	else if (progressive)
+	{
+		// the image is out, the checkpoint is no longer needed
+		std::error_code ec;
+		std::filesystem::remove(checkpoint_file, ec);
+	}
+
+	// a shard holds its sample counts already
+	if (sample_aov && !shard)
+	{
+		std::vector<float> counts(sample_counts.begin(), sample_counts.end());
+		std::string aov_file = output_file.substr(0, output_file.size() - 4) + "_samples.exr";
+		ret = SaveEXR(counts.data(), image_width, image_height, 1, false, aov_file.c_str(), &err);
+		std::cerr << "\nwriting to " << aov_file << ", ret = " << ret;
+		if (ret < 0)
+			std::cerr << ", error info: " << err;
+	}
+
+	delete[] output;
+
+	return ret;
+}
+
+// one frame asked of the server, it starts out with the camera and image size of the scene's xml
+struct render_job
+{
+	int id = 0;
+	point3 lookfrom;
+	point3 lookat;
+	vec3 vup;
+	fType vfov = 40.0;
+	int image_width = 0, image_height = 0;
+	int samples_per_pixel = 0;
+	std::string output_file;
+
+	std::chrono::steady_clock::time_point received;
+	// jobs waiting in front of it when it was received
+	size_t queue_depth = 0;
+};
+
+// a job is a line of flags, any of -s <spp> -res <width> <height> -eye <x> <y> <z> -lookat <x> <y> <z>
+// -up <x> <y> <z> -fovy <degrees> -o <output>
+bool parse_job(const std::string& line, render_job& job)
+{
+	std::istringstream stream(line);
+	std::vector<std::string> args;
+	for (std::string arg; stream >> arg; )
+		args.push_back(arg);
+
+	try
+	{
+		for (size_t i = 0; i < args.size(); )
+		{
+			auto values = [&](size_t count)
+				{
+					if (i + count >= args.size())
+						throw std::invalid_argument(args[i] + " is missing its values");
+					i += count + 1;
+					return &args[i - count];
+				};
+			auto to_vec3 = [](const std::string* v) { return vec3(std::stof(v[0]), std::stof(v[1]), std::stof(v[2])); };
+
+			if (args[i] == "-s")
+				job.samples_per_pixel = std::stoi(*values(1));
+			else if (args[i] == "-res")
+			{
+				const std::string* v = values(2);
+				job.image_width = std::stoi(v[0]);
+				job.image_height = std::stoi(v[1]);
+			}
+			else if (args[i] == "-eye")
+				job.lookfrom = to_vec3(values(3));
+			else if (args[i] == "-lookat")
+				job.lookat = to_vec3(values(3));
+			else if (args[i] == "-up")
+				job.vup = to_vec3(values(3));
+			else if (args[i] == "-fovy")
+				job.vfov = std::stof(*values(1));
+			else if (args[i] == "-o")
+				job.output_file = *values(1);
+			else
+				throw std::invalid_argument("unknow job argument " + args[i]);
+		}
+	}
+	catch (const std::exception& e)
+	{
+		WARN("bad job \"%s\": %s.", line.c_str(), e.what());
+		return false;
+	}
+
+	if (job.samples_per_pixel < 1 || job.image_width < 1 || job.image_height < 1)
+	{
+		WARN("bad job \"%s\": spp and resolution must be positive.", line.c_str());
+		return false;
+	}
+	return true;
+}
+
+// the scene stays loaded, jobs skip the parsing of the obj and the bvh build. a thread reads jobs from
+// stdin while the previous ones render, so they queue up and are taken in order. every finished job
+// reports how long it waited and rendered, and the latency statistics of all jobs so far.
+// "quit" or the end of stdin stops the server once the queue is empty
+void run_server(Scene& scene, const render_job& defaults)
+{
+	std::deque<render_job> queue;
+	std::mutex queue_mutex;
+	std::condition_variable queue_cv;
+	bool closed = false;
+
+	std::thread reader([&]()
+		{
+			int next_id = 0;
+			for (std::string line; std::getline(std::cin, line); )
+			{
+				line.erase(0, line.find_first_not_of(" \t\r"));
+				line.erase(line.find_last_not_of(" \t\r") + 1);
+				if (line.empty() || line[0] == '#')
+					continue;
+				if (line == "quit")
+					break;
+
+				render_job job = defaults;
+				job.id = next_id++;
+				if (!parse_job(line, job))
+					continue;
+				if (job.output_file.empty())
+					job.output_file = model_name + "_job" + std::to_string(job.id) + ".exr";
+
+				std::lock_guard<std::mutex> lock(queue_mutex);
+				job.received = std::chrono::steady_clock::now();
+				job.queue_depth = queue.size();
+				queue.push_back(job);
+				queue_cv.notify_one();
+			}
+
+			std::lock_guard<std::mutex> lock(queue_mutex);
+			closed = true;
+			queue_cv.notify_one();
+		});
+
+	std::vector<double> latencies;
+	double wait_sum = 0.0;
+	size_t depth_sum = 0, max_depth_seen = 0;
+	while (true)
+	{
+		render_job job;
+		size_t waiting;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_cv.wait(lock, [&]() { return closed || !queue.empty(); });
+			if (queue.empty())
+				break;
+			job = queue.front();
+			queue.pop_front();
+			waiting = queue.size();
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		// time budgets count from the start of the job
+		program_start = start;
+		samples_per_pixel = job.samples_per_pixel;
+		camera cam(job.lookfrom, job.lookat, job.vup, job.vfov, static_cast<fType>(job.image_width) / job.image_height);
+		if (mipmapping)
+			cam.set_image_size(job.image_width, job.image_height);
+		int ret = render_frame(scene, cam, job.image_width, job.image_height, render_tile{ 0, 0, job.image_width, job.image_height }, job.output_file);
+		auto finish = std::chrono::steady_clock::now();
+		std::cerr << "\n";
+
+		double wait = std::chrono::duration<double>(start - job.received).count();
+		double render = std::chrono::duration<double>(finish - start).count();
+		latencies.push_back(wait + render);
+		wait_sum += wait;
+		depth_sum += job.queue_depth;
+		max_depth_seen = std::max(max_depth_seen, job.queue_depth);
+
+		std::vector<double> sorted = latencies;
+		std::sort(sorted.begin(), sorted.end());
+		auto percentile = [&](double p) { return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))]; };
+		double latency_sum = 0.0;
+		for (double latency : sorted)
+			latency_sum += latency;
+
+		INFO("job %d %s: %dx%d at %d spp, %zu jobs in front of it when received, %zu queued now, waited %.3fs, rendered in %.3fs",
+			job.id, ret < 0 ? "failed" : "done", job.image_width, job.image_height, job.samples_per_pixel, job.queue_depth, waiting, wait, render);
+		INFO("%zu jobs, latency mean %.3fs p50 %.3fs p95 %.3fs max %.3fs, mean wait %.3fs, queue depth mean %.2f max %zu",
+			sorted.size(), latency_sum / sorted.size(), percentile(0.5), percentile(0.95), sorted.back(), wait_sum / sorted.size(),
+			static_cast<double>(depth_sum) / sorted.size(), max_depth_seen);
+		fflush(stdout);
+	}
+
+	reader.join();
+}
+
+// writes the image of the shards, the average of their samples in every pixel
+int merge(const std::string& output_file, const std::vector<std::string>& shard_files)
+{
+	int image_width, image_height;
+	std::vector<float> output;
+	std::vector<int> sample_counts;
+	if (!merge_shards(shard_files, image_width, image_height, output, sample_counts))
+		return 1;
+
+	if (gamma_correct)
+	{
+		for (float& value : output)
+			value = std::pow(value, 1.0f / 2.2f);
+	}
+
+	int min_samples = *std::min_element(sample_counts.begin(), sample_counts.end());
+	int max_samples = *std::max_element(sample_counts.begin(), sample_counts.end());
+	double total_samples = 0.0;
+	for (int count : sample_counts)
+		total_samples += count;
+	INFO("merged %zu shards, %.1f spp on average (%d to %d)", shard_files.size(), total_samples / sample_counts.size(), min_samples, max_samples);
+
+	const char* err;
+	int ret = SaveEXR(output.data(), image_width, image_height, 3, false, output_file.c_str(), &err);
+	std::cerr << "writing to " << output_file << ", ret = " << ret;
+	if (ret < 0)
+		std::cerr << ", error info: " << err;
+
+	if (sample_aov && ret >= 0)
+	{
+		std::vector<float> counts(sample_counts.begin(), sample_counts.end());
+		std::string aov_file = output_file.substr(0, output_file.rfind('.')) + "_samples.exr";
+		ret = SaveEXR(counts.data(), image_width, image_height, 1, false, aov_file.c_str(), &err);
+		std::cerr << "\nwriting to " << aov_file << ", ret = " << ret;
+		if (ret < 0)
+			std::cerr << ", error info: " << err;
+	}
+	std::cerr << "\n";
+
+	return ret < 0 ? 1 : 0;
+}
+
 int parse_arg(int argc, const char* argv[])
 {
 	for (size_t i = 1; i < argc; )
@@ -139,6 +1169,222 @@ int parse_arg(int argc, const char* argv[])
 			++i; if (i >= argc) { return -1; }
             samples_per_pixel = std::stoi(argv[i++]);
 		}
+		else if (!strcmp(argv[i], "-bvh"))
+		{
+			++i; if (i >= argc) { return -1; }
+			if (!strcmp(argv[i], "sah"))
+				bvh_config.split_method = bvh_split_method::sah;
+			else if (!strcmp(argv[i], "middle"))
+				bvh_config.split_method = bvh_split_method::middle;
+			else
+			{
+				WARN("unknow bvh split method %s.", argv[i]);
+				return -1;
+			}
+			++i;
+		}
+		else if (!strcmp(argv[i], "-bins"))
+		{
+			++i; if (i >= argc) { return -1; }
+			int bins = std::stoi(argv[i++]);
+			if (bins < 2)
+			{
+				WARN("bin count must be at least 2.");
+				return -1;
+			}
+			bvh_config.bin_count = bins;
+		}
+		else if (!strcmp(argv[i], "-bvhwidth"))
+		{
+			++i; if (i >= argc) { return -1; }
+			bvh_config.width = std::stoi(argv[i++]);
+			if (bvh_config.width != 2 && bvh_config.width != 4 && bvh_config.width != 8)
+			{
+				WARN("bvh width must be 2, 4 or 8.");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-leafcost"))
+		{
+			++i; if (i >= argc) { return -1; }
+			bvh_config.leaf_cost = std::stof(argv[i++]);
+		}
+		else if (!strcmp(argv[i], "-packet"))
+		{
+			++i; if (i >= argc) { return -1; }
+			packet_size = std::stoi(argv[i++]);
+			if (packet_size != 0 && packet_size != 4 && packet_size != 8 && packet_size != 16)
+			{
+				WARN("packet size must be 0, 4, 8 or 16.");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-tile"))
+		{
+			++i; if (i >= argc) { return -1; }
+			tile_config.tile_size = std::stoi(argv[i++]);
+			if (tile_config.tile_size < 1)
+			{
+				WARN("tile size must be positive.");
+				return -1;
+			}
+		}
+		else if (!strcmp(argv[i], "-tileorder"))
+		{
+			++i; if (i >= argc) { return -1; }
+			if (!strcmp(argv[i], "scanline"))
+				tile_config.order = tile_order::scanline;
+			else if (!strcmp(argv[i], "morton"))
+				tile_config.order = tile_order::morton;
+			else if (!strcmp(argv[i], "hilbert"))
+				tile_config.order = tile_order::hilbert;
+			else
+			{
+				WARN("unknow tile order %s.", argv[i]);
+				return -1;
+			}
+			++i;
+		}
+		else if (!strcmp(argv[i], "-threads"))
+		{
+			++i; if (i >= argc) { return -1; }
+			tile_config.thread_count = std::stoi(argv[i++]);
+		}
+		else if (!strcmp(argv[i], "-adaptive"))
+		{
+			++i; if (i >= argc) { return -1; }
+			adaptive_threshold = std::stof(argv[i++]);
+		}
+		else if (!strcmp(argv[i], "-timebudget") || !strcmp(argv[i], "--time-budget"))
+		{
+			++i; if (i >= argc) { return -1; }
+			time_budget = std::stod(argv[i++]);
+		}
+		else if (!strcmp(argv[i], "-checkpoint"))
+		{
+			++i; if (i >= argc) { return -1; }
+			checkpoint_interval = std::stod(argv[i++]);
+		}
+		else if (!strcmp(argv[i], "-resume") || !strcmp(argv[i], "--resume"))
+		{
+			++i;
+			resume = true;
+		}
+		else if (!strcmp(argv[i], "-maxspp"))
+		{
+			++i; if (i >= argc) { return -1; }
+			adaptive_max_spp = std::stoi(argv[i++]);
+		}
+		else if (!strcmp(argv[i], "-sampleaov"))
+		{
+			++i;
+			sample_aov = true;
+		}
+		else if (!strcmp(argv[i], "-sampler"))
+		{
+			++i; if (i >= argc) { return -1; }
+			if (!strcmp(argv[i], "independent"))
+				default_sampler = sampler_type::independent;
+			else if (!strcmp(argv[i], "sobol"))
+				default_sampler = sampler_type::sobol;
+			else if (!strcmp(argv[i], "pmj02"))
+				default_sampler = sampler_type::pmj02;
+			else
+			{
+				WARN("unknow sampler %s.", argv[i]);
+				return -1;
+			}
+			++i;
+		}
+		else if (!strcmp(argv[i], "-region"))
+		{
+			++i; if (i + 4 > argc) { return -1; }
+			shard_region.x0 = std::stoi(argv[i++]);
+			shard_region.y0 = std::stoi(argv[i++]);
+			shard_region.x1 = std::stoi(argv[i++]);
+			shard_region.y1 = std::stoi(argv[i++]);
+			if (shard_region.x0 < 0 || shard_region.y0 < 0 || shard_region.x1 <= shard_region.x0 || shard_region.y1 <= shard_region.y0)
+			{
+				WARN("region must be x0 y0 x1 y1 with x0 < x1 and y0 < y1.");
+				return -1;
+			}
+			shard = true;
+		}
+		else if (!strcmp(argv[i], "-samplerange"))
+		{
+			++i; if (i + 2 > argc) { return -1; }
+			first_sample = std::stoi(argv[i++]);
+			end_sample = std::stoi(argv[i++]);
+			if (first_sample < 0 || end_sample <= first_sample)
+			{
+				WARN("sample range must be first end with first < end.");
+				return -1;
+			}
+			shard = true;
+		}
+		else if (!strcmp(argv[i], "-merge"))
+		{
+			// -merge <output> <shard>..., takes the rest of the command line
+			++i; if (i + 2 > argc) { return -1; }
+			merge_output = argv[i++];
+			while (i < argc)
+				merge_inputs.push_back(argv[i++]);
+		}
+		else if (!strcmp(argv[i], "-server"))
+		{
+			++i;
+			server = true;
+		}
+		else if (!strcmp(argv[i], "-nocache"))
+		{
+			++i;
+			use_cache = false;
+		}
+		else if (!strcmp(argv[i], "-buildcache"))
+		{
+			++i;
+			build_cache = true;
+		}
+		else if (!strcmp(argv[i], "-serialobj"))
+		{
+			++i;
+			serial_obj = true;
+		}
+		else if (!strcmp(argv[i], "-nomip"))
+		{
+			++i;
+			mipmapping = false;
+		}
+		else if (!strcmp(argv[i], "-wavefront"))
+		{
+			++i;
+			wavefront = true;
+		}
+		else if (!strcmp(argv[i], "-pool"))
+		{
+			++i; if (i >= argc) { return -1; }
+			pool_size = std::stoi(argv[i++]);
+		}
+		else if (!strcmp(argv[i], "-raysort"))
+		{
+			++i;
+			sort_rays = true;
+		}
+		else if (!strcmp(argv[i], "-benchrays"))
+		{
+			++i;
+			bench_rays = true;
+		}
+		else if (!strcmp(argv[i], "-benchrng"))
+		{
+			++i;
+			bench_rng = true;
+		}
+		else if (!strcmp(argv[i], "-benchthreads"))
+		{
+			++i;
+			bench_threads = true;
+		}
 		else if (!strcmp(argv[i], "-g"))
 		{
 		    ++i; if (i >= argc) { return -1; }
@@ -156,9 +1402,48 @@ int parse_arg(int argc, const char* argv[])
 
 int main(int argc, const char * argv[])
 {
+    program_start = std::chrono::steady_clock::now();
+
     if (parse_arg(argc, argv))
         return 1;
 
+    if (bench_rng)
+    {
+        benchmark_rng();
+        return 0;
+    }
+    if (!merge_output.empty())
+        return merge(merge_output, merge_inputs);
+
+    if (end_sample > 0)
+        samples_per_pixel = end_sample - first_sample;
+    if (shard && gamma_correct)
+    {
+        WARN("shards are written linear to be merged, -g is applied by -merge.");
+        gamma_correct = false;
+    }
+    if (server && (shard || resume))
+    {
+        WARN("the server renders whole frames from the start, -region, -samplerange and -resume are ignored.");
+        shard = resume = false;
+        first_sample = 0;
+        shard_region = render_tile{ 0, 0, 0, 0 };
+    }
+
+    // every parallel region follows -threads, not only the tile scheduler
+    if (tile_config.thread_count > 0)
+        omp_set_num_threads(tile_config.thread_count);
+
+    if (sort_rays && !wavefront)
+        WARN("-raysort sorts the rays of the wavefront integrator, add -wavefront to use it.");
+    const bool progressive = adaptive_threshold > 0 || time_budget > 0 || checkpoint_interval > 0 || resume;
+    if (progressive && (wavefront || packet_size > 0))
+        WARN("progressive rendering traces one path at a time, -wavefront and -packet are ignored.");
+    if (default_sampler != sampler_type::independent && packet_size > 0 && !progressive)
+        WARN("ray packets draw their samples lane by lane, they ignore -sampler.");
+    if ((packet_size > 0 || bench_rays) && bvh_config.width != 2)
+        WARN("ray packets traverse the binary bvh, with bvh%u they are traced one ray at a time.", bvh_config.width);
+
     //image
     fType aspect_ratio;
     int image_width, image_height;
@@ -220,78 +1505,101 @@ int main(int argc, const char * argv[])
 	//lights
 	scene.lights = make_shared<hittable_list>();
 	shared_ptr<model> model_ptr = make_shared<model>();
-    if (!model_ptr->loadObj(model_path, scene.lights, matname2radiance))
+    model_ptr->parallel_parse = !serial_obj;
+    std::string cache_path = resource_dir + "/" + model_name + "/" + model_name + ".rgcache";
+
+    // textures, welding and the bvh are built by jobs, side by side where their dependencies allow, on -threads workers
+    job_graph startup(tile_config.thread_count > 0 ? tile_config.thread_count : std::thread::hardware_concurrency());
+    bool cached = false;
+    if (use_cache && !build_cache)
+    {
+        startup.run("load scene cache", [&]()
+            {
+                cached = load_scene_cache(cache_path, model_path, *model_ptr, scene, scene.lights, matname2radiance, bvh_config, startup);
+            });
+    }
+    if (!cached && !model_ptr->loadObj(model_path, scene.lights, matname2radiance, startup))
         exit(1);
 
-    scene.add_model(model_ptr);
-    scene.init();
+    scene.bvh_config = bvh_config;
+    startup.add("build bvh", [&]()
+        {
+            scene.add_model(model_ptr);
+            scene.init();
+        }, { model_ptr->meshes_ready });
+    startup.wait();
+    model_ptr->printTextures();
+    startup.print_timeline();
+
+    if (build_cache)
+    {
+        if (!save_scene_cache(cache_path, model_path, *model_ptr, scene, bvh_config))
+        {
+            WARN("failed to write scene cache %s", cache_path.c_str());
+            return 1;
+        }
+        INFO("wrote scene cache %s", cache_path.c_str());
+        return 0;
+    }
 
     //camera
     camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus);
+    if (mipmapping)
+        cam.set_image_size(image_width, image_height);
     
-    //output exr
-    std::string output_file = model_name + "_" + std::to_string(samples_per_pixel) + ".exr";
-    int output_size = image_width * image_height * 3;
-    float* output = new float[output_size];
-
-    //render
-    fType sample_scale = 1.0 / samples_per_pixel;
-    int total_pixels = image_width * image_height;
-    int current_pixels = 0;
+    if (bench_rays)
+    {
+        benchmark_primary_rays(scene, cam, image_width, image_height);
+        return 0;
+    }
+    if (bench_threads)
+    {
+        benchmark_threads(scene, cam, image_width, image_height);
+        scene.print_occluder_stats();
+        return 0;
+    }
+    if (server)
+    {
+        INFO("%s loaded in %.2fs, reading jobs from stdin", model_name.c_str(),
+            static_cast<float>(std::chrono::duration<double>(std::chrono::steady_clock::now() - program_start).count()));
+        fflush(stdout);
 
-    clock_t start_time = clock();
+        render_job defaults;
+        defaults.lookfrom = lookfrom;
+        defaults.lookat = lookat;
+        defaults.vup = vup;
+        defaults.vfov = vfov;
+        defaults.image_width = image_width;
+        defaults.image_height = image_height;
+        defaults.samples_per_pixel = samples_per_pixel;
+        run_server(scene, defaults);
+        return 0;
+    }
 
-#pragma omp parallel for
-    for(int y = 0; y < image_height; y++)
+    // rows are rendered from the bottom of the image, the shard region counts them from the top
+    render_tile region{ 0, 0, image_width, image_height };
+    if (shard_region.x1 > 0)
     {
-        for(int x = 0; x < image_width; x++)
+        if (shard_region.x1 > image_width || shard_region.y1 > image_height)
         {
-            color pixel_color(0, 0, 0);
-            for(int s = 0; s < samples_per_pixel; s++)
-            {
-                fType u = (x + random_value()) / image_width;
-                fType v = (y + random_value()) / image_height;
-
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, scene);
-            }
-
-            //write color
-			fType r = sample_scale * pixel_color.r;
-			fType g = sample_scale * pixel_color.g;
-			fType b = sample_scale * pixel_color.b;
-
-			// Divide the color by the number of samples and gamma-correct for gamma = 2.2
-            if (gamma_correct)
-            {
-				fType gamma = 1.0 / 2.2;
-				r = std::pow(r, gamma);
-				g = std::pow(g, gamma);
-				b = std::pow(b, gamma);
-            }
-
-			int flip_y = image_height - 1 - y;
-			int index = 3 * (flip_y * image_width + x);
-
-			output[index + 0] = static_cast<float>(r);
-			output[index + 1] = static_cast<float>(g);
-			output[index + 2] = static_cast<float>(b);
-#pragma omp atomic
-			current_pixels += 1;
-
-			printf("\rrendering %.2f%%...", (100.0f * current_pixels) / total_pixels);
+            WARN("region %d %d %d %d is outside of the %dx%d image.", shard_region.x0, shard_region.y0, shard_region.x1, shard_region.y1,
+                image_width, image_height);
+            exit(1);
         }
+        region = render_tile{ shard_region.x0, image_height - shard_region.y1, shard_region.x1, image_height - shard_region.y0 };
     }
 
-    printf("\rrendering %.2f%%...", 100.0f);
+    //output exr
+    std::string output_file = model_name + "_" + (time_budget > 0 ? std::to_string(static_cast<int>(time_budget)) + "s" : std::to_string(samples_per_pixel));
+    if (shard)
+        output_file += "_shard_" + std::to_string(shard_region.x0) + "_" + std::to_string(shard_region.y0) + "_" + std::to_string(region.x1)
+            + "_" + std::to_string(image_height - region.y0) + "_from_" + std::to_string(first_sample);
+    output_file += ".exr";
 
-    const char* err;
-    int ret = SaveEXR(output, image_width, image_height, 3, false, output_file.c_str(), &err);
-    std::cerr << "\nwriting to " << output_file << ", ret = " << ret;
-    if(ret < 0)
-        std::cerr << ", error info: " << err;
+    //render
+    clock_t start_time = clock();
 
-    delete[] output;
+    render_frame(scene, cam, image_width, image_height, region, output_file);
 
     clock_t finish_time = clock();
     double seconds = (finish_time - start_time) / CLOCKS_PER_SEC;